@@ -5,6 +5,37 @@
 #include <cmath>
 #include <numeric>
 #include <stdexcept>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <filesystem>
+#include <ctime>
+#include <functional>
+#include <queue>
+#include <cctype>
+#include <random>
 
 // Constants for BMP file
 const int BYTES_PER_PIXEL = 3; // red, green, & blue
@@ -26,30 +57,433 @@ struct PixelData {
     double value;
     bool is_calibrated;
 };
-void generateBitmapImage(const unsigned char* image, int height, int width, const char* imageFileName)
-{
-    int widthInBytes = width * BYTES_PER_PIXEL;
 
-    unsigned char padding[3] = {0, 0, 0};
-    int paddingSize = (4 - (widthInBytes) % 4) % 4;
+#ifdef ALLOC_TEST
+// Count of heap allocations made through operator new, used by --alloc-test to verify that
+// steady-state processing with pooled frame buffers does not allocate. Test builds only
+// (-DALLOC_TEST), so production binaries keep the default allocator.
+std::atomic<size_t> heap_allocation_count{0};
+
+[[gnu::noinline]] void* operator new(size_t size) {
+    heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// Frame-sized buffers at least this large are backed by transparent huge pages when enabled
+const size_t HUGE_PAGE_SIZE = 2u << 20;
+bool use_huge_pages = false;
+
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        size_t bytes = count * sizeof(T);
+        if (use_huge_pages && bytes >= HUGE_PAGE_SIZE) {
+            size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            void* p = std::aligned_alloc(HUGE_PAGE_SIZE, rounded);
+            if (!p) {
+                throw std::bad_alloc();
+            }
+            madvise(p, rounded, MADV_HUGEPAGE);
+            return static_cast<T*>(p);
+        }
+        return static_cast<T*>(::operator new(bytes));
+    }
+
+    void deallocate(T* p, size_t count) {
+        if (use_huge_pages && count * sizeof(T) >= HUGE_PAGE_SIZE) {
+            std::free(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U>&) const { return false; }
+};
+
+using FrameBytes = std::vector<unsigned char, HugePageAllocator<unsigned char>>;
+using FrameWords = std::vector<unsigned, HugePageAllocator<unsigned>>;
+
+// Per-label timing of scheduler tasks, reported with --task-stats
+struct TaskTiming {
+    const char* label;
+    size_t count;
+    long long total_ns;
+    long long max_ns;
+};
+
+class TaskStats {
+public:
+    TaskStats() {
+        timings.reserve(64);
+    }
+
+    void record(const char* label, long long ns) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& timing : timings) {
+            if (timing.label == label) {
+                ++timing.count;
+                timing.total_ns += ns;
+                timing.max_ns = std::max(timing.max_ns, ns);
+                return;
+            }
+        }
+        if (timings.size() < timings.capacity()) {
+            timings.push_back({label, 1, ns, ns});
+        }
+    }
+
+    void report(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "task timings (label: count, total ms, mean us, max us)" << std::endl;
+        for (const auto& timing : timings) {
+            out << "  " << timing.label << ": " << timing.count << ", " << std::fixed << std::setprecision(3)
+                << timing.total_ns / 1e6 << ", " << timing.total_ns / 1e3 / timing.count << ", " << timing.max_ns / 1e3 << std::endl;
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<TaskTiming> timings;
+};
+
+TaskStats task_stats;
+
+// Non-owning reference to a range body, so submitting tasks never allocates
+class RangeFunction {
+public:
+    template <typename F>
+    explicit RangeFunction(F& body)
+        : object(&body), call([](void* o, size_t begin, size_t end) { (*static_cast<F*>(o))(begin, end); }) {}
+
+    void operator()(size_t begin, size_t end) const { call(object, begin, end); }
+
+private:
+    void* object;
+    void (*call)(void*, size_t, size_t);
+};
+
+// Work-stealing scheduler behind every data-parallel stage (calibration bands, render strips,
+// clustering chunks). Each worker owns a deque: it pops its newest task and, when empty, steals the
+// oldest task of another worker. Threads waiting on a parallel_for help run pending tasks of any scan,
+// so concurrent pipelines and service requests share one set of threads. on_start runs first on every
+// worker thread (the NUMA executor pins a node's scheduler to that node's CPUs with it).
+class TaskScheduler {
+public:
+    explicit TaskScheduler(unsigned thread_count, std::function<void()> on_start = {})
+        : deques(thread_count > 1 ? thread_count - 1 : 0), on_start(std::move(on_start)) {
+        for (auto& deque : deques) {
+            deque.ring.resize(TASK_DEQUE_CAPACITY);
+        }
+        for (size_t index = 0; index < deques.size(); ++index) {
+            threads.emplace_back([this, index]() { worker_loop(index); });
+        }
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    unsigned thread_count() const { return deques.size() + 1; }
+
+    // Scheduler that scheduler() hands to the calling thread instead of the shared one, if any
+    static TaskScheduler* routed() { return routed_scheduler; }
+
+    // Sends the calling thread's parallel_for calls to this scheduler
+    void route_current_thread() { routed_scheduler = this; }
+
+    // Runs body(begin, end) over [0, count) in chunks of at most grain items and returns when all are done
+    template <typename F>
+    void parallel_for(const char* label, size_t count, size_t grain, F&& body) {
+        RangeFunction function(body);
+        run(label, count, std::max<size_t>(grain, 1), function);
+    }
+
+private:
+    static const size_t TASK_DEQUE_CAPACITY = 4096;
+
+    struct TaskGroup {
+        std::atomic<size_t> remaining{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct Task {
+        const RangeFunction* body;
+        size_t begin;
+        size_t end;
+        TaskGroup* group;
+        const char* label;
+    };
+
+    // Fixed-capacity deque; the owner works at the tail, thieves take from the head
+    struct TaskDeque {
+        std::mutex mutex;
+        std::vector<Task> ring;
+        size_t head = 0;
+        size_t size = 0;
+    };
+
+    static thread_local const TaskScheduler* current_scheduler;
+    static thread_local size_t current_worker;
+    static thread_local TaskScheduler* routed_scheduler;
+
+    void run(const char* label, size_t count, size_t grain, const RangeFunction& body) {
+        size_t chunks = (count + grain - 1) / grain;
+        if (deques.empty() || chunks <= 1) {
+            execute({&body, 0, count, nullptr, label});
+            return;
+        }
+        TaskGroup group;
+        group.remaining = chunks;
+        bool on_worker = current_scheduler == this;
+        size_t target = on_worker ? current_worker : next_external++ % deques.size();
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            Task task{&body, chunk * grain, std::min(count, (chunk + 1) * grain), &group, label};
+            TaskDeque& deque = deques[on_worker ? target : (target + chunk) % deques.size()];
+            std::unique_lock<std::mutex> lock(deque.mutex);
+            if (deque.size == deque.ring.size()) {
+                lock.unlock();
+                execute(task);
+                continue;
+            }
+            deque.ring[(deque.head + deque.size++) % deque.ring.size()] = task;
+            queued.fetch_add(1, std::memory_order_release);
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_all();
+
+        while (group.remaining.load(std::memory_order_acquire) > 0) {
+            if (!run_one(on_worker ? current_worker : target)) {
+                std::this_thread::yield();
+            }
+        }
+        if (group.error) {
+            std::rethrow_exception(group.error);
+        }
+    }
+
+    void execute(const Task& task) {
+        auto start = std::chrono::steady_clock::now();
+        try {
+            (*task.body)(task.begin, task.end);
+        } catch (...) {
+            if (!task.group) {
+                throw;
+            }
+            std::lock_guard<std::mutex> lock(task.group->error_mutex);
+            if (!task.group->error) {
+                task.group->error = std::current_exception();
+            }
+        }
+        task_stats.record(task.label, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        if (task.group) {
+            task.group->remaining.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    // Pops the newest task of the preferred deque, otherwise steals the oldest task of another one
+    bool run_one(size_t preferred) {
+        for (size_t offset = 0; offset < deques.size(); ++offset) {
+            TaskDeque& deque = deques[(preferred + offset) % deques.size()];
+            std::unique_lock<std::mutex> lock(deque.mutex);
+            if (deque.size == 0) {
+                continue;
+            }
+            Task task;
+            if (offset == 0) {
+                task = deque.ring[(deque.head + --deque.size) % deque.ring.size()];
+            } else {
+                task = deque.ring[deque.head];
+                deque.head = (deque.head + 1) % deque.ring.size();
+                --deque.size;
+            }
+            lock.unlock();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            execute(task);
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(size_t index) {
+        if (on_start) {
+            on_start();
+        }
+        current_scheduler = this;
+        current_worker = index;
+        route_current_thread();
+        while (true) {
+            if (run_one(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [&]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    std::vector<TaskDeque> deques;
+    std::function<void()> on_start;
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> next_external{0};
+    bool stopping = false;
+};
+
+thread_local const TaskScheduler* TaskScheduler::current_scheduler = nullptr;
+thread_local size_t TaskScheduler::current_worker = 0;
+thread_local TaskScheduler* TaskScheduler::routed_scheduler = nullptr;
+
+// Thread count of the shared scheduler, set with --threads (0 = one per hardware thread)
+unsigned scheduler_threads = 0;
+
+// The calling thread's scheduler: its NUMA node's scheduler on a NUMA batch worker, else the shared one
+TaskScheduler& scheduler() {
+    if (TaskScheduler* routed = TaskScheduler::routed()) {
+        return *routed;
+    }
+    static TaskScheduler instance(scheduler_threads ? scheduler_threads : std::max(1u, std::thread::hardware_concurrency()));
+    return instance;
+}
+
+const size_t ROW_GRAIN = 16;
+const size_t COLUMN_GRAIN = 256;
+// Streams a BMP row by row into a file or a caller-provided memory block,
+// so callers only ever hold a few rows of pixels
+class BitmapWriter {
+public:
+    BitmapWriter(int height, int width, const char* imageFileName) : width(width)
+    {
+        imageFile = fopen(imageFileName, "wb");
+        if (!imageFile) {
+            throw std::runtime_error(std::string("Error: could not create file ") + imageFileName);
+        }
+        write_headers(height);
+    }
+
+    BitmapWriter(int height, int width, unsigned char* memory, size_t capacity)
+        : imageFile(nullptr), width(width), memory(memory), memoryCapacity(capacity)
+    {
+        if (file_size(height, width) > capacity) {
+            throw std::runtime_error("Error: bitmap does not fit the output buffer.");
+        }
+        write_headers(height);
+    }
+
+    ~BitmapWriter()
+    {
+        if (imageFile) {
+            fclose(imageFile);
+        }
+    }
+
+    static size_t file_size(int height, int width)
+    {
+        int widthInBytes = width * BYTES_PER_PIXEL;
+        int stride = widthInBytes + (4 - (widthInBytes) % 4) % 4;
+        return FILE_HEADER_SIZE + INFO_HEADER_SIZE + static_cast<size_t>(stride) * height;
+    }
+
+    // row holds width * BYTES_PER_PIXEL bytes in BGR order
+    void write_row(const unsigned char* row)
+    {
+        static const unsigned char padding[3] = {0, 0, 0};
+        put(row, static_cast<size_t>(width) * BYTES_PER_PIXEL);
+        put(padding, paddingSize);
+    }
+
+    // Bytes written so far to the memory block
+    size_t size() const { return memorySize; }
 
-    int stride = (widthInBytes) + paddingSize;
+    void close()
+    {
+        if (!imageFile) {
+            return;
+        }
+        bool failed = ferror(imageFile) != 0;
+        failed |= fclose(imageFile) != 0;
+        imageFile = nullptr;
+        if (failed) {
+            throw std::runtime_error("Error: failed to write bitmap file.");
+        }
+    }
+
+private:
+    void write_headers(int height)
+    {
+        int widthInBytes = width * BYTES_PER_PIXEL;
+        paddingSize = (4 - (widthInBytes) % 4) % 4;
+        int stride = (widthInBytes) + paddingSize;
 
-    FILE* imageFile = fopen(imageFileName, "wb");
+        unsigned char* fileHeader = createBitmapFileHeader(height, stride);
+        put(fileHeader, FILE_HEADER_SIZE);
+
+        unsigned char* infoHeader = createBitmapInfoHeader(height, width);
+        put(infoHeader, INFO_HEADER_SIZE);
+    }
+
+    void put(const unsigned char* bytes, size_t count)
+    {
+        if (imageFile) {
+            fwrite(bytes, 1, count, imageFile);
+        } else {
+            std::memcpy(memory + memorySize, bytes, count);
+            memorySize += count;
+        }
+    }
 
-    unsigned char* fileHeader = createBitmapFileHeader(height, stride);
-    fwrite(fileHeader, 1, FILE_HEADER_SIZE, imageFile);
+    FILE* imageFile;
+    int width;
+    int paddingSize = 0;
+    unsigned char* memory = nullptr;
+    size_t memoryCapacity = 0;
+    size_t memorySize = 0;
+};
 
-    unsigned char* infoHeader = createBitmapInfoHeader(height, width);
-    fwrite(infoHeader, 1, INFO_HEADER_SIZE, imageFile);
+void generateBitmapImage(const unsigned char* image, int height, int width, const char* imageFileName)
+{
+    int widthInBytes = width * BYTES_PER_PIXEL;
 
+    BitmapWriter writer(height, width, imageFileName);
     int i;
     for (i = 0; i < height; i++) {
-        fwrite(image + (i*widthInBytes), BYTES_PER_PIXEL, width, imageFile);
-        fwrite(padding, 1, paddingSize, imageFile);
+        writer.write_row(image + (i*widthInBytes));
     }
-
-    fclose(imageFile);
+    writer.close();
 }
 
 unsigned char* createBitmapFileHeader(int height, int stride)
@@ -105,184 +539,5535 @@ unsigned char* createBitmapInfoHeader(int height, int width)
     return infoHeader;
 }
 
-// Function to read data from file
-std::vector<std::vector<int>> read_data_from_file(const std::string& filename, unsigned& height, unsigned& width) {
-    std::ifstream inf(filename, std::fstream::in | std::fstream::binary);
-    if (!inf.is_open()) {
-        throw std::runtime_error("Error: could not open file " + filename);
+// Output image formats. The encoder of an output is chosen by its file extension; --format sets
+// the extension of the images the modes name themselves.
+enum class ImageFormat { Bmp, Png, Qoi, Tiff };
+
+ImageFormat output_format = ImageFormat::Bmp;
+
+const char* format_extension(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::Png: return "png";
+    case ImageFormat::Qoi: return "qoi";
+    case ImageFormat::Tiff: return "tif";
+    default: return "bmp";
     }
+}
 
-    inf.read(reinterpret_cast<char*>(&width), sizeof(unsigned));
-    inf.read(reinterpret_cast<char*>(&height), sizeof(unsigned));
-    
-    // Skip the next 14 unsigned integers (header info)
-    inf.seekg(static_cast<unsigned>(inf.tellg()) + sizeof(unsigned) * 14);
+ImageFormat format_of(const std::string& filename) {
+    size_t dot = filename.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (extension == "png") return ImageFormat::Png;
+    if (extension == "qoi") return ImageFormat::Qoi;
+    if (extension == "tif" || extension == "tiff") return ImageFormat::Tiff;
+    return ImageFormat::Bmp;
+}
 
-    if (height == 0 || width == 0) {
-        throw std::runtime_error("Error: image dimensions cannot be zero.");
+// "<stem>.<extension of the selected output format>"
+std::string image_name(const std::string& stem) {
+    return stem + "." + format_extension(output_format);
+}
+
+void write_file(const std::string& filename, const std::vector<unsigned char>& bytes) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Error: could not create file " + filename);
     }
-    
-    std::vector<std::vector<int>> data(height, std::vector<int>(width));
-    unsigned number;
-    for (unsigned i = 0; i < height; ++i) {
-        for (unsigned j = 0; j < width; ++j) {
-            inf.read(reinterpret_cast<char*>(&number), 4);
-            data[i][j] = static_cast<int>(number);
-        }
+    bool failed = fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size();
+    failed |= fclose(file) != 0;
+    if (failed) {
+        throw std::runtime_error("Error: failed to write " + filename);
     }
-    inf.close();
-    return data;
 }
 
-// function to process data
-std::vector<std::vector<PixelData>> process_data(const std::vector<std::vector<int>>& data) {
-    unsigned m = data.size();
-    unsigned n = data[0].size();
-    std::vector<std::vector<PixelData>> processed_data(m, std::vector<PixelData>(n));
-    // Background normalization
-    for (unsigned i = 0; i < m; ++i) {
-        for (unsigned j = 0; j < n; ++j) {
-            if (data[i][j] > SIGNAL_THRESHOLD) {
-                processed_data[i][j].value = data[i][j] - SIGNAL_THRESHOLD;
-            } else {
-                processed_data[i][j].value = 0;
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = []() {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t k = 0; k < 256; ++k) {
+            uint32_t c = k;
+            for (int bit = 0; bit < 8; ++bit) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
             }
-            processed_data[i][j].is_calibrated = false;
+            entries[k] = c;
         }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t k = 0; k < size; ++k) {
+        crc = table[(crc ^ data[k]) & 0xFF] ^ (crc >> 8);
     }
+    return ~crc;
+}
 
-    // Calibration by beta-thorne (last 15 rows)
-    if (m < BETA_THORNE_ROWS_COUNT) {
-        throw std::runtime_error("Error: Not enough rows for beta-thorne calibration.");
-    }
-    std::vector<double> median_betathrone(n, 0.0);
-    for (unsigned j = 0; j < n; ++j) {
-        double sum = 0.0;
-        for (unsigned i = m - BETA_THORNE_ROWS_COUNT; i < m; ++i) {
-            sum += processed_data[i][j].value;
-            processed_data[i][j].is_calibrated = true;
+// Adler-32 of a concatenation from the checksums of its parts (the second part being length2 bytes)
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+    const uint32_t BASE = 65521;
+    uint32_t remainder = length2 % BASE;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % BASE);
+    sum1 += (adler2 & 0xFFFF) + BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - remainder;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= 2 * BASE) sum2 -= 2 * BASE;
+    if (sum2 >= BASE) sum2 -= BASE;
+    return sum1 | (sum2 << 16);
+}
+
+uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler = 1) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (size > 0) {
+        // 5552 is the largest block whose sums cannot overflow before the modulo
+        size_t block = std::min<size_t>(size, 5552);
+        for (size_t k = 0; k < block; ++k) {
+            a += data[k];
+            b += a;
         }
-        median_betathrone[j] = sum / BETA_THORNE_ROWS_COUNT;
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        size -= block;
     }
-    double overall_median = std::accumulate(median_betathrone.begin(), median_betathrone.end(), 0.0) / n;
-    
-    for (unsigned i = 0; i < m; ++i) {
-        for (unsigned j = 0; j < n; ++j) {
-            if (!processed_data[i][j].is_calibrated) {
-                if (median_betathrone[j] != 0) {
-                    double proportion = overall_median / median_betathrone[j];
-                    processed_data[i][j].value *= proportion;
-                }
-                else{
-                    processed_data[i][j].value = 0.0;
-                }
-            }
+    return (b << 16) | a;
+}
+
+// Writes bits least significant first, as deflate requires
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+    void put(uint32_t value, unsigned count) {
+        buffer |= static_cast<uint64_t>(value) << filled;
+        filled += count;
+        while (filled >= 8) {
+            out.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            filled -= 8;
         }
     }
 
-    // Calibration by detectors (last 50 columns)
-    if (n < MEDIAN_DETECTOR_COUNT) {
-         throw std::runtime_error("Error: Not enough columns for detector calibration.");
-    }
-    std::vector<double> median_detector(m, 0.0);
-    for (unsigned i = 0; i < m; ++i) {
-        double sum = 0.0;
-        for (unsigned j = n - MEDIAN_DETECTOR_COUNT; j < n; ++j) {
-            if (!processed_data[i][j].is_calibrated) {
-                sum += processed_data[i][j].value;
-                processed_data[i][j].is_calibrated = true;
-            }
+    void align() {
+        if (filled > 0) {
+            out.push_back(static_cast<unsigned char>(buffer));
+            buffer = 0;
+            filled = 0;
         }
-        median_detector[i] = sum / MEDIAN_DETECTOR_COUNT;
     }
 
-    for (unsigned i = 0; i < m; ++i) {
-        for (unsigned j = 0; j < n; ++j) {
-            if (!processed_data[i][j].is_calibrated) {
-                processed_data[i][j].value /= median_detector[i];
+private:
+    std::vector<unsigned char>& out;
+    uint64_t buffer = 0;
+    unsigned filled = 0;
+};
+
+// Code lengths of a Huffman code for the given frequencies, limited to max_bits by flattening
+// the frequencies until the tree is shallow enough
+void huffman_lengths(std::vector<uint32_t> frequencies, unsigned max_bits, std::vector<uint8_t>& lengths) {
+    size_t symbols = frequencies.size();
+    lengths.assign(symbols, 0);
+    for (;;) {
+        std::vector<uint64_t> weight;
+        std::vector<int> parent;
+        std::vector<size_t> leaf_symbol;
+        using Entry = std::pair<uint64_t, int>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+        for (size_t s = 0; s < symbols; ++s) {
+            if (frequencies[s] > 0) {
+                heap.push({frequencies[s], static_cast<int>(weight.size())});
+                weight.push_back(frequencies[s]);
+                parent.push_back(-1);
+                leaf_symbol.push_back(s);
+            }
+        }
+        size_t leaves = weight.size();
+        while (heap.size() > 1) {
+            Entry a = heap.top();
+            heap.pop();
+            Entry b = heap.top();
+            heap.pop();
+            int node = weight.size();
+            weight.push_back(a.first + b.first);
+            parent.push_back(-1);
+            parent[a.second] = node;
+            parent[b.second] = node;
+            heap.push({a.first + b.first, node});
+        }
+        unsigned deepest = 0;
+        for (size_t leaf = 0; leaf < leaves; ++leaf) {
+            unsigned depth = 0;
+            for (int node = leaf; parent[node] >= 0; node = parent[node]) {
+                ++depth;
             }
-            if (processed_data[i][j].value > 1.0) {
-                processed_data[i][j].value = 1.0;
+            lengths[leaf_symbol[leaf]] = std::max(depth, 1u);
+            deepest = std::max(deepest, depth);
+        }
+        if (deepest <= max_bits) {
+            return;
+        }
+        for (auto& frequency : frequencies) {
+            if (frequency > 0) {
+                frequency = std::max<uint32_t>(1, frequency >> 1);
             }
         }
     }
-    return processed_data;
 }
 
-void create_and_save_image(const std::vector<std::vector<PixelData>>& data, const std::string& filename) {
-    unsigned m = data.size();
-    unsigned n = data[0].size();
-    std::vector<unsigned char> image(m * n * BYTES_PER_PIXEL);
-    
-    for (unsigned i = 0; i < m; ++i) {
-        for (unsigned j = 0; j < n; ++j) {
-            int pixel_index = (i * n + j) * BYTES_PER_PIXEL;
-            if (data[i][j].is_calibrated) {
-                image[pixel_index + 2] = 255; // Red
-                image[pixel_index + 1] = 0;
-                image[pixel_index + 0] = 0;
-            } else {
-                unsigned char color_value = static_cast<unsigned char>(data[i][j].value * 255);
-                image[pixel_index + 2] = color_value; // Red
-                image[pixel_index + 1] = color_value; // Green
-                image[pixel_index + 0] = color_value; // Blue
-            }
+// Canonical codes for code lengths, bit-reversed for the LSB-first bit writer
+void canonical_codes(const std::vector<uint8_t>& lengths, std::vector<uint16_t>& codes) {
+    unsigned count[16] = {0};
+    for (uint8_t length : lengths) {
+        count[length]++;
+    }
+    count[0] = 0;
+    unsigned next[16] = {0};
+    unsigned code = 0;
+    for (unsigned bits = 1; bits < 16; ++bits) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    codes.assign(lengths.size(), 0);
+    for (size_t s = 0; s < lengths.size(); ++s) {
+        if (lengths[s] == 0) {
+            continue;
         }
+        unsigned value = next[lengths[s]]++;
+        unsigned reversed = 0;
+        for (unsigned bit = 0; bit < lengths[s]; ++bit) {
+            reversed = (reversed << 1) | ((value >> bit) & 1);
+        }
+        codes[s] = reversed;
     }
-    generateBitmapImage(image.data(), m, n, filename.c_str());
 }
 
-// Function to calculate and save thickness image
-void calculate_and_save_thickness(const std::vector<std::vector<PixelData>>& data, const std::string& filename) {
-    unsigned m = data.size();
-    unsigned n = data[0].size();
-    std::vector<unsigned char> image(m * n * BYTES_PER_PIXEL);
-    double min_thickness = std::numeric_limits<double>::max();
+// Deflate (RFC 1951) with hash-chain LZ77 and one dynamic Huffman block per DEFLATE_BLOCK_TOKENS
+// tokens. A short chain keeps it fast; image rows repeat enough that deeper searches gain little.
+const unsigned DEFLATE_WINDOW = 32768;
+const unsigned DEFLATE_HASH_BITS = 15;
+const unsigned DEFLATE_MAX_CHAIN = 8;
+const unsigned DEFLATE_MIN_MATCH = 3;
+const unsigned DEFLATE_MAX_MATCH = 258;
+const size_t DEFLATE_BLOCK_TOKENS = 1 << 16;
 
-    std::vector<std::vector<double>> thickness_data(m, std::vector<double>(n));
+const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
-    for (unsigned i = 0; i < m; ++i) {
-        for (unsigned j = 0; j < n; ++j) {
-            int pixel_index = (i * n + j) * BYTES_PER_PIXEL;
-            double v = data[i][j].value;
-            double t = (v > 0.0) ? -std::log(v) : 10.0;
-            int iv = static_cast<int>(std::round(t * 25.0));
-            if (iv < 0) iv = 0;
-            if (iv > 255) iv = 255;
-            unsigned char color_value = static_cast<unsigned char>(iv);
-            image[pixel_index + 2] = color_value;
-            image[pixel_index + 1] = color_value;
-            image[pixel_index + 0] = color_value;
+// A token is a literal byte, or a match with the length in bits 16-24 and the distance below
+const uint32_t MATCH_TOKEN = 1u << 31;
+
+unsigned length_code(unsigned length) {
+    return std::upper_bound(LENGTH_BASE, LENGTH_BASE + 29, length) - LENGTH_BASE - 1;
+}
+
+unsigned distance_code(unsigned distance) {
+    return std::upper_bound(DISTANCE_BASE, DISTANCE_BASE + 30, distance) - DISTANCE_BASE - 1;
+}
+
+// Ensures a code has at least two symbols so that every tree is complete
+void ensure_two_symbols(std::vector<uint32_t>& frequencies) {
+    size_t used = std::count_if(frequencies.begin(), frequencies.end(), [](uint32_t f) { return f > 0; });
+    for (size_t s = 0; used < 2 && s < frequencies.size(); ++s) {
+        if (frequencies[s] == 0) {
+            frequencies[s] = 1;
+            ++used;
         }
     }
-    generateBitmapImage(image.data(), m, n, filename.c_str());
 }
 
-int main() {
-    try {
-        unsigned m, n;
-        auto data = read_data_from_file("block.int", m, n);
-        auto processed_data = process_data(data);
-        create_and_save_image(processed_data, "normalized_image.bmp");
-        
-        std::cout << "Image 'normalized_image.bmp' generated successfully." << std::endl;
+void write_deflate_block(BitWriter& bits, const std::vector<uint32_t>& tokens, bool final) {
+    std::vector<uint32_t> literal_frequencies(286, 0), distance_frequencies(30, 0);
+    literal_frequencies[256] = 1;
+    for (uint32_t token : tokens) {
+        if (token & MATCH_TOKEN) {
+            literal_frequencies[257 + length_code((token >> 16) & 0x1FF)]++;
+            distance_frequencies[distance_code(token & 0xFFFF)]++;
+        } else {
+            literal_frequencies[token]++;
+        }
+    }
+    ensure_two_symbols(literal_frequencies);
+    ensure_two_symbols(distance_frequencies);
+    std::vector<uint8_t> literal_lengths, distance_lengths;
+    huffman_lengths(literal_frequencies, 15, literal_lengths);
+    huffman_lengths(distance_frequencies, 15, distance_lengths);
+    unsigned hlit = 286, hdist = 30;
+    while (hlit > 257 && literal_lengths[hlit - 1] == 0) --hlit;
+    while (hdist > 1 && distance_lengths[hdist - 1] == 0) --hdist;
 
-        int choice;
-        std::cout << "Input 1 to check thickness: ";
-        std::cin >> choice;
-        if (choice == 1) {
-            calculate_and_save_thickness(processed_data, "thickness_image.bmp");
-            std::cout << "Image 'thickness_image.bmp' generated successfully." << std::endl;
+    // Run-length coded code lengths: 16 repeats the previous length, 17 and 18 encode zero runs
+    std::vector<uint8_t> lengths(literal_lengths.begin(), literal_lengths.begin() + hlit);
+    lengths.insert(lengths.end(), distance_lengths.begin(), distance_lengths.begin() + hdist);
+    std::vector<std::pair<uint8_t, uint8_t>> runs;
+    for (size_t i = 0; i < lengths.size(); ) {
+        size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == lengths[i]) {
+            ++run;
+        }
+        if (lengths[i] == 0 && run >= 3) {
+            size_t take = std::min<size_t>(run, 138);
+            runs.push_back({static_cast<uint8_t>(take >= 11 ? 18 : 17), static_cast<uint8_t>(take >= 11 ? take - 11 : take - 3)});
+            i += take;
+        } else if (lengths[i] != 0 && run >= 4) {
+            size_t take = std::min<size_t>(run - 1, 6);
+            runs.push_back({lengths[i], 0});
+            runs.push_back({16, static_cast<uint8_t>(take - 3)});
+            i += take + 1;
+        } else {
+            runs.push_back({lengths[i], 0});
+            ++i;
         }
+    }
+    std::vector<uint32_t> code_length_frequencies(19, 0);
+    for (const auto& run : runs) {
+        code_length_frequencies[run.first]++;
+    }
+    ensure_two_symbols(code_length_frequencies);
+    std::vector<uint8_t> code_length_lengths;
+    huffman_lengths(code_length_frequencies, 7, code_length_lengths);
+    unsigned hclen = 19;
+    while (hclen > 4 && code_length_lengths[CODE_LENGTH_ORDER[hclen - 1]] == 0) --hclen;
 
-    } catch (const std::exception& e) {
-        std::cerr << "An error occurred: " << e.what() << std::endl;
-        return 1;
+    std::vector<uint16_t> literal_codes, distance_codes, code_length_codes;
+    canonical_codes(literal_lengths, literal_codes);
+    canonical_codes(distance_lengths, distance_codes);
+    canonical_codes(code_length_lengths, code_length_codes);
+
+    bits.put(final ? 1 : 0, 1);
+    bits.put(2, 2);
+    bits.put(hlit - 257, 5);
+    bits.put(hdist - 1, 5);
+    bits.put(hclen - 4, 4);
+    for (unsigned k = 0; k < hclen; ++k) {
+        bits.put(code_length_lengths[CODE_LENGTH_ORDER[k]], 3);
+    }
+    for (const auto& run : runs) {
+        bits.put(code_length_codes[run.first], code_length_lengths[run.first]);
+        if (run.first >= 16) {
+            bits.put(run.second, run.first == 16 ? 2 : run.first == 17 ? 3 : 7);
+        }
     }
+    for (uint32_t token : tokens) {
+        if (token & MATCH_TOKEN) {
+            unsigned length = (token >> 16) & 0x1FF;
+            unsigned distance = token & 0xFFFF;
+            unsigned lcode = length_code(length);
+            unsigned dcode = distance_code(distance);
+            bits.put(literal_codes[257 + lcode], literal_lengths[257 + lcode]);
+            bits.put(length - LENGTH_BASE[lcode], LENGTH_EXTRA[lcode]);
+            bits.put(distance_codes[dcode], distance_lengths[dcode]);
+            bits.put(distance - DISTANCE_BASE[dcode], DISTANCE_EXTRA[dcode]);
+        } else {
+            bits.put(literal_codes[token], literal_lengths[token]);
+        }
+    }
+    bits.put(literal_codes[256], literal_lengths[256]);
+}
 
-    return 0;
+// Compresses data as a sequence of deflate blocks appended to out. The last block is marked final
+// when final is set; otherwise the stream is ended with an empty stored block so that it stops on
+// a byte boundary and further deflate data can follow it. The history bytes before data (already
+// compressed by the preceding chunk) may be referenced by matches, as the decoder holds them too.
+void deflate_chunk(const unsigned char* chunk, size_t chunk_size, bool final, std::vector<unsigned char>& out, size_t history = 0) {
+    history = std::min<size_t>(history, DEFLATE_WINDOW);
+    const unsigned char* data = chunk - history;
+    size_t size = history + chunk_size;
+    BitWriter bits(out);
+    std::vector<int32_t> head(1u << DEFLATE_HASH_BITS, -1);
+    std::vector<int32_t> previous(DEFLATE_WINDOW, -1);
+    auto hash = [&](size_t pos) {
+        uint32_t v = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+        return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+    };
+    auto insert = [&](size_t pos) {
+        uint32_t h = hash(pos);
+        previous[pos & (DEFLATE_WINDOW - 1)] = head[h];
+        head[h] = pos;
+    };
+    for (size_t k = 0; k < history && k + DEFLATE_MIN_MATCH <= size; ++k) {
+        insert(k);
+    }
+    std::vector<uint32_t> tokens;
+    tokens.reserve(DEFLATE_BLOCK_TOKENS);
+    size_t pos = history;
+    while (pos < size) {
+        unsigned best_length = 0, best_distance = 0;
+        if (pos + DEFLATE_MIN_MATCH <= size) {
+            unsigned limit = std::min<size_t>(DEFLATE_MAX_MATCH, size - pos);
+            int32_t candidate = head[hash(pos)];
+            for (unsigned chain = 0; chain < DEFLATE_MAX_CHAIN && candidate >= 0 && pos - candidate <= DEFLATE_WINDOW; ++chain) {
+                const unsigned char* a = data + candidate;
+                const unsigned char* b = data + pos;
+                if (a[best_length] == b[best_length]) {
+                    unsigned length = 0;
+                    while (length < limit && a[length] == b[length]) {
+                        ++length;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = pos - candidate;
+                        if (length == limit) {
+                            break;
+                        }
+                    }
+                }
+                int32_t next = previous[candidate & (DEFLATE_WINDOW - 1)];
+                if (next >= candidate) {
+                    break;
+                }
+                candidate = next;
+            }
+            insert(pos);
+        }
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            tokens.push_back(MATCH_TOKEN | (best_length << 16) | best_distance);
+            for (size_t k = pos + 1; k < pos + best_length && k + DEFLATE_MIN_MATCH <= size; ++k) {
+                insert(k);
+            }
+            pos += best_length;
+        } else {
+            tokens.push_back(data[pos]);
+            ++pos;
+        }
+        if (tokens.size() == DEFLATE_BLOCK_TOKENS && pos < size) {
+            write_deflate_block(bits, tokens, false);
+            tokens.clear();
+        }
+    }
+    write_deflate_block(bits, tokens, final);
+    if (!final) {
+        bits.put(0, 3);
+        bits.align();
+        const unsigned char empty_stored[4] = {0x00, 0x00, 0xFF, 0xFF};
+        out.insert(out.end(), empty_stored, empty_stored + 4);
+    }
+    bits.align();
 }
 
+void put_u32_be(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+const size_t DEFLATE_CHUNK_SIZE = 128u << 10;
+
+// zlib body (deflate data and Adler-32) of data, appended to out. The data is cut into chunks of
+// DEFLATE_CHUNK_SIZE that are compressed and checksummed concurrently; each chunk may match into
+// the window before it, and all but the last end byte-aligned, so the concatenation is a single
+// valid deflate stream and the chunk checksums combine into the stream's Adler-32.
+void zlib_compress_parallel(const std::vector<unsigned char>& data, std::vector<unsigned char>& out) {
+    size_t chunks = std::max<size_t>(1, (data.size() + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE);
+    std::vector<std::vector<unsigned char>> compressed(chunks);
+    std::vector<uint32_t> checksums(chunks);
+    scheduler().parallel_for("deflate", chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            size_t first = c * DEFLATE_CHUNK_SIZE;
+            size_t size = std::min(DEFLATE_CHUNK_SIZE, data.size() - first);
+            deflate_chunk(data.data() + first, size, c + 1 == chunks, compressed[c], first);
+            checksums[c] = adler32(data.data() + first, size);
+        }
+    });
+    uint32_t checksum = checksums[0];
+    for (size_t c = 0; c < chunks; ++c) {
+        out.insert(out.end(), compressed[c].begin(), compressed[c].end());
+        if (c > 0) {
+            checksum = adler32_combine(checksum, checksums[c], std::min(DEFLATE_CHUNK_SIZE, data.size() - c * DEFLATE_CHUNK_SIZE));
+        }
+    }
+    put_u32_be(out, checksum);
+}
+
+void append_png_chunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data) {
+    put_u32_be(png, data.size());
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    put_u32_be(png, crc32(&png[start], png.size() - start));
+}
+
+// True when every pixel of packed BGR data has equal channels
+bool is_grey(const unsigned char* image, size_t pixels) {
+    for (size_t k = 0; k < pixels; ++k) {
+        if (image[3 * k] != image[3 * k + 1] || image[3 * k] != image[3 * k + 2]) {
+            return false;
+        }
+    }
+    return true;
+}
 
+int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
 
+// Packed BGR rows are kept bottom-up, as a BMP stores them: the encoders below write the last row
+// first so that every format shows the image the same way up.
 
+// PNG of packed BGR rows. Images whose pixels are all grey are stored as 8-bit greyscale. Rows are
+// converted and filtered in parallel; each row takes the filter with the smallest sum of absolute
+// residuals, the usual heuristic for photographic content.
+std::vector<unsigned char> encode_png(const unsigned char* image, int height, int width) {
+    size_t pixels = static_cast<size_t>(height) * width;
+    bool grey = is_grey(image, pixels);
+    unsigned channels = grey ? 1 : 3;
+    size_t row_bytes = static_cast<size_t>(width) * channels;
+    std::vector<unsigned char> raw(row_bytes * height);
+    std::vector<unsigned char> filtered((row_bytes + 1) * height);
+    scheduler().parallel_for("png convert", height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const unsigned char* source = image + (height - 1 - i) * width * 3;
+            unsigned char* target = &raw[i * row_bytes];
+            for (int j = 0; j < width; ++j) {
+                if (grey) {
+                    target[j] = source[3 * j];
+                } else {
+                    target[3 * j + 0] = source[3 * j + 2];
+                    target[3 * j + 1] = source[3 * j + 1];
+                    target[3 * j + 2] = source[3 * j + 0];
+                }
+            }
+        }
+    });
+    scheduler().parallel_for("png filter", height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        std::vector<unsigned char> candidate(row_bytes);
+        const std::vector<unsigned char> zero_row(row_bytes, 0);
+        for (size_t i = begin; i < end; ++i) {
+            const unsigned char* row = &raw[i * row_bytes];
+            const unsigned char* up = i > 0 ? &raw[(i - 1) * row_bytes] : zero_row.data();
+            unsigned char* target = &filtered[i * (row_bytes + 1)];
+            uint64_t best_cost = UINT64_MAX;
+            // One simple loop per filter type so that the compiler can vectorize the first four
+            for (unsigned char filter = 0; filter < 5; ++filter) {
+                unsigned char* out = candidate.data();
+                for (size_t x = 0; x < channels; ++x) {
+                    int b = up[x];
+                    out[x] = row[x] - (filter == 2 || filter == 4 ? b : filter == 3 ? b / 2 : 0);
+                }
+                switch (filter) {
+                case 0:
+                    std::copy(row + channels, row + row_bytes, out + channels);
+                    break;
+                case 1:
+                    for (size_t x = channels; x < row_bytes; ++x) out[x] = row[x] - row[x - channels];
+                    break;
+                case 2:
+                    for (size_t x = channels; x < row_bytes; ++x) out[x] = row[x] - up[x];
+                    break;
+                case 3:
+                    for (size_t x = channels; x < row_bytes; ++x) out[x] = row[x] - ((row[x - channels] + up[x]) >> 1);
+                    break;
+                default:
+                    for (size_t x = channels; x < row_bytes; ++x) out[x] = row[x] - paeth(row[x - channels], up[x], up[x - channels]);
+                }
+                uint64_t cost = 0;
+                for (size_t x = 0; x < row_bytes; ++x) {
+                    cost += static_cast<unsigned char>(std::abs(static_cast<signed char>(out[x])));
+                }
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    target[0] = filter;
+                    std::copy(candidate.begin(), candidate.end(), target + 1);
+                }
+            }
+        }
+    });
+
+    std::vector<unsigned char> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    std::vector<unsigned char> header;
+    put_u32_be(header, width);
+    put_u32_be(header, height);
+    header.insert(header.end(), {8, static_cast<unsigned char>(grey ? 0 : 2), 0, 0, 0});
+    append_png_chunk(png, "IHDR", header);
+    std::vector<unsigned char> stream = {0x78, 0x01};
+    zlib_compress_parallel(filtered, stream);
+    append_png_chunk(png, "IDAT", stream);
+    append_png_chunk(png, "IEND", {});
+    return png;
+}
+
+const unsigned QOI_STRIP_ROWS = 32;
+
+// QOI of packed BGR rows. Strips of QOI_STRIP_ROWS rows are encoded in parallel: a strip starts
+// from the last pixel of the previous strip (known from the image), keeps its own colour index
+// (entries it never wrote cannot match an opaque pixel) and ends any run at its last row, so the
+// concatenated strips decode exactly like a sequentially encoded stream.
+std::vector<unsigned char> encode_qoi(const unsigned char* image, int height, int width) {
+    struct Rgba {
+        unsigned char r, g, b, a;
+        bool operator==(const Rgba& o) const { return r == o.r && g == o.g && b == o.b && a == o.a; }
+    };
+    auto pixel_at = [&](size_t k) {
+        const unsigned char* bgr = image + 3 * ((height - 1 - k / width) * static_cast<size_t>(width) + k % width);
+        return Rgba{bgr[2], bgr[1], bgr[0], 255};
+    };
+    unsigned strips = (height + QOI_STRIP_ROWS - 1) / QOI_STRIP_ROWS;
+    std::vector<std::vector<unsigned char>> encoded(strips);
+    scheduler().parallel_for("qoi encode", strips, 1, [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; ++s) {
+            size_t first = s * QOI_STRIP_ROWS * static_cast<size_t>(width);
+            size_t last = std::min<size_t>(static_cast<size_t>(height), (s + 1) * QOI_STRIP_ROWS) * width;
+            std::vector<unsigned char>& out = encoded[s];
+            out.reserve((last - first) * 2);
+            Rgba index[64] = {};
+            Rgba previous = first > 0 ? pixel_at(first - 1) : Rgba{0, 0, 0, 255};
+            unsigned run = 0;
+            for (size_t k = first; k < last; ++k) {
+                Rgba px = pixel_at(k);
+                if (px == previous) {
+                    if (++run == 62 || k + 1 == last) {
+                        out.push_back(0xC0 | (run - 1));
+                        run = 0;
+                    }
+                    continue;
+                }
+                if (run > 0) {
+                    out.push_back(0xC0 | (run - 1));
+                    run = 0;
+                }
+                unsigned slot = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+                if (index[slot] == px) {
+                    out.push_back(slot);
+                } else {
+                    index[slot] = px;
+                    int dr = px.r - previous.r, dg = px.g - previous.g, db = px.b - previous.b;
+                    dr = static_cast<signed char>(dr);
+                    dg = static_cast<signed char>(dg);
+                    db = static_cast<signed char>(db);
+                    int dr_dg = dr - dg, db_dg = db - dg;
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                        out.push_back(0x80 | (dg + 32));
+                        out.push_back(((dr_dg + 8) << 4) | (db_dg + 8));
+                    } else {
+                        out.insert(out.end(), {0xFE, px.r, px.g, px.b});
+                    }
+                }
+                previous = px;
+            }
+        }
+    });
+    std::vector<unsigned char> qoi = {'q', 'o', 'i', 'f'};
+    put_u32_be(qoi, width);
+    put_u32_be(qoi, height);
+    qoi.push_back(3);  // RGB
+    qoi.push_back(0);  // sRGB with linear alpha
+    for (const auto& strip : encoded) {
+        qoi.insert(qoi.end(), strip.begin(), strip.end());
+    }
+    qoi.insert(qoi.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    return qoi;
+}
+
+// Tiled pyramidal TIFF. Every resolution level (each half the size of the previous one, down to a
+// single tile) is a separate image file directory, the reduced ones marked as such, so a viewer
+// opens the level matching its zoom and reads only the visible tiles. Tiles are encoded
+// concurrently and, with deflate, each is its own zlib stream after horizontal differencing.
+const unsigned TIFF_TILE_SIZE = 256;
+
+struct TiffOptions {
+    unsigned bits = 8;    // 8: the rendered image; 16: greyscale straight from the calibrated values
+    bool deflate = true;  // per-tile deflate with the horizontal-differencing predictor
+};
+
+// Set with --tiff-bits and --tiff-compression
+TiffOptions tiff_options;
+
+// Interleaved samples of one resolution level
+template <typename Sample>
+struct SampleImage {
+    std::vector<Sample> samples;
+    unsigned width = 0;
+    unsigned height = 0;
+    unsigned channels = 1;
+};
+
+// 2x2 box average, rounding; odd edges average the samples that exist
+template <typename Sample>
+SampleImage<Sample> half_resolution(const SampleImage<Sample>& image) {
+    SampleImage<Sample> half;
+    half.width = (image.width + 1) / 2;
+    half.height = (image.height + 1) / 2;
+    half.channels = image.channels;
+    half.samples.resize(static_cast<size_t>(half.width) * half.height * half.channels);
+    scheduler().parallel_for("tiff pyramid", half.height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y) {
+            unsigned y0 = 2 * y, y1 = std::min(2 * y + 1, static_cast<size_t>(image.height - 1));
+            for (unsigned x = 0; x < half.width; ++x) {
+                unsigned x0 = 2 * x, x1 = std::min(2 * x + 1, image.width - 1);
+                for (unsigned c = 0; c < image.channels; ++c) {
+                    auto at = [&](unsigned yy, unsigned xx) {
+                        return static_cast<uint32_t>(image.samples[(static_cast<size_t>(yy) * image.width + xx) * image.channels + c]);
+                    };
+                    uint32_t sum = at(y0, x0) + at(y0, x1) + at(y1, x0) + at(y1, x1);
+                    half.samples[(y * half.width + x) * half.channels + c] = static_cast<Sample>((sum + 2) / 4);
+                }
+            }
+        }
+    });
+    return half;
+}
+
+void put_u16_le(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value);
+    out.push_back(value >> 8);
+}
+
+void put_u32_le(std::vector<unsigned char>& out, uint32_t value) {
+    put_u16_le(out, value & 0xFFFF);
+    put_u16_le(out, value >> 16);
+}
+
+// Tile (tx, ty) of a level as TIFF bytes: padded to the full tile size, then optionally
+// differenced and deflated
+template <typename Sample>
+std::vector<unsigned char> encode_tiff_tile(const SampleImage<Sample>& image, unsigned tx, unsigned ty, bool deflate) {
+    size_t row_samples = static_cast<size_t>(TIFF_TILE_SIZE) * image.channels;
+    std::vector<Sample> tile(row_samples * TIFF_TILE_SIZE, 0);
+    for (unsigned r = 0; r < TIFF_TILE_SIZE && ty * TIFF_TILE_SIZE + r < image.height; ++r) {
+        size_t y = ty * TIFF_TILE_SIZE + r;
+        unsigned columns = std::min(TIFF_TILE_SIZE, image.width - tx * TIFF_TILE_SIZE);
+        const Sample* source = &image.samples[(y * image.width + tx * TIFF_TILE_SIZE) * image.channels];
+        std::copy(source, source + static_cast<size_t>(columns) * image.channels, &tile[r * row_samples]);
+    }
+    if (deflate) {
+        for (unsigned r = 0; r < TIFF_TILE_SIZE; ++r) {
+            Sample* row = &tile[r * row_samples];
+            for (size_t k = row_samples - 1; k >= image.channels; --k) {
+                row[k] = static_cast<Sample>(row[k] - row[k - image.channels]);
+            }
+        }
+    }
+    std::vector<unsigned char> bytes;
+    bytes.reserve(tile.size() * sizeof(Sample));
+    for (Sample sample : tile) {
+        for (unsigned b = 0; b < sizeof(Sample); ++b) {
+            bytes.push_back(static_cast<unsigned char>(sample >> (8 * b)));
+        }
+    }
+    if (!deflate) {
+        return bytes;
+    }
+    std::vector<unsigned char> stream = {0x78, 0x01};
+    deflate_chunk(bytes.data(), bytes.size(), true, stream);
+    put_u32_be(stream, adler32(bytes.data(), bytes.size()));
+    return stream;
+}
+
+template <typename Sample>
+std::vector<unsigned char> encode_tiff(SampleImage<Sample> image, bool deflate) {
+    std::vector<unsigned char> tiff = {'I', 'I', 42, 0};
+    size_t next_ifd_field = tiff.size();
+    put_u32_le(tiff, 0);
+    for (unsigned level = 0; ; ++level) {
+        unsigned across = (image.width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+        unsigned down = (image.height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+        std::vector<std::vector<unsigned char>> tiles(static_cast<size_t>(across) * down);
+        scheduler().parallel_for("tiff tiles", tiles.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                tiles[t] = encode_tiff_tile(image, t % across, t / across, deflate);
+            }
+        });
+        std::vector<uint32_t> offsets, counts;
+        for (const auto& tile : tiles) {
+            offsets.push_back(tiff.size());
+            counts.push_back(tile.size());
+            tiff.insert(tiff.end(), tile.begin(), tile.end());
+            if (tiff.size() % 2) {
+                tiff.push_back(0);
+            }
+        }
+
+        // Values that do not fit an entry follow the directory
+        struct Entry {
+            uint16_t tag;
+            uint16_t type;  // 3 = SHORT, 4 = LONG
+            std::vector<uint32_t> values;
+        };
+        uint16_t bits = 8 * sizeof(Sample);
+        std::vector<Entry> entries = {
+            {254, 4, {level > 0 ? 1u : 0u}},                       // NewSubfileType: reduced resolution
+            {256, 4, {image.width}},
+            {257, 4, {image.height}},
+            {258, 3, std::vector<uint32_t>(image.channels, bits)},  // BitsPerSample
+            {259, 3, {deflate ? 8u : 1u}},                          // Compression: Adobe deflate or none
+            {262, 3, {image.channels == 3 ? 2u : 1u}},              // Photometric: RGB or BlackIsZero
+            {277, 3, {image.channels}},                             // SamplesPerPixel
+            {284, 3, {1}},                                          // PlanarConfiguration: interleaved
+        };
+        if (deflate) {
+            entries.push_back({317, 3, {2}});                       // Predictor: horizontal differencing
+        }
+        entries.push_back({322, 4, {TIFF_TILE_SIZE}});
+        entries.push_back({323, 4, {TIFF_TILE_SIZE}});
+        entries.push_back({324, 4, offsets});
+        entries.push_back({325, 4, counts});
+
+        size_t directory = tiff.size();
+        size_t extra = directory + 2 + entries.size() * 12 + 4;
+        std::vector<unsigned char> extra_values;
+        tiff[next_ifd_field] = directory;
+        tiff[next_ifd_field + 1] = directory >> 8;
+        tiff[next_ifd_field + 2] = directory >> 16;
+        tiff[next_ifd_field + 3] = directory >> 24;
+        put_u16_le(tiff, entries.size());
+        for (const auto& entry : entries) {
+            size_t size = entry.values.size() * (entry.type == 3 ? 2 : 4);
+            put_u16_le(tiff, entry.tag);
+            put_u16_le(tiff, entry.type);
+            put_u32_le(tiff, entry.values.size());
+            std::vector<unsigned char>& target = size <= 4 ? tiff : extra_values;
+            if (size > 4) {
+                put_u32_le(tiff, extra + extra_values.size());
+            }
+            for (uint32_t value : entry.values) {
+                entry.type == 3 ? put_u16_le(target, value) : put_u32_le(target, value);
+            }
+            for (size_t k = size; k < 4; ++k) {
+                target.push_back(0);
+            }
+        }
+        next_ifd_field = tiff.size();
+        put_u32_le(tiff, 0);
+        tiff.insert(tiff.end(), extra_values.begin(), extra_values.end());
+
+        if (image.width <= TIFF_TILE_SIZE && image.height <= TIFF_TILE_SIZE) {
+            break;
+        }
+        image = half_resolution(image);
+    }
+    return tiff;
+}
+
+// 8-bit TIFF of packed BGR rows; all-grey images are stored with one sample per pixel
+std::vector<unsigned char> encode_tiff_rgb(const unsigned char* image, int height, int width) {
+    size_t pixels = static_cast<size_t>(height) * width;
+    SampleImage<uint8_t> level;
+    level.width = width;
+    level.height = height;
+    level.channels = is_grey(image, pixels) ? 1 : 3;
+    level.samples.resize(pixels * level.channels);
+    for (size_t k = 0; k < pixels; ++k) {
+        const unsigned char* bgr = image + 3 * ((height - 1 - k / width) * static_cast<size_t>(width) + k % width);
+        if (level.channels == 1) {
+            level.samples[k] = bgr[0];
+        } else {
+            level.samples[3 * k + 0] = bgr[2];
+            level.samples[3 * k + 1] = bgr[1];
+            level.samples[3 * k + 2] = bgr[0];
+        }
+    }
+    return encode_tiff(std::move(level), tiff_options.deflate);
+}
+
+// 16-bit greyscale TIFF of a plane, with sample(value) mapping each calibrated value to 0-65535;
+// the last row comes first, as in the 8-bit images
+template <typename SampleOf>
+void save_tiff16(const std::vector<std::vector<PixelData>>& data, const std::string& filename, SampleOf sample) {
+    SampleImage<uint16_t> level;
+    level.height = data.size();
+    level.width = data[0].size();
+    level.samples.resize(static_cast<size_t>(level.width) * level.height);
+    scheduler().parallel_for("tiff samples", level.height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (unsigned j = 0; j < level.width; ++j) {
+                level.samples[i * level.width + j] = sample(data[level.height - 1 - i][j].value);
+            }
+        }
+    });
+    write_file(filename, encode_tiff(std::move(level), tiff_options.deflate));
+}
+
+// Writes packed BGR rows (width * BYTES_PER_PIXEL bytes each) in the format of the file extension
+void save_rgb_image(const unsigned char* image, int height, int width, const std::string& filename) {
+    switch (format_of(filename)) {
+    case ImageFormat::Png:
+        write_file(filename, encode_png(image, height, width));
+        break;
+    case ImageFormat::Qoi:
+        write_file(filename, encode_qoi(image, height, width));
+        break;
+    case ImageFormat::Tiff:
+        write_file(filename, encode_tiff_rgb(image, height, width));
+        break;
+    default:
+        generateBitmapImage(image, height, width, filename.c_str());
+    }
+}
+
+// The 16-word header at the start of every raw scan file
+struct ScanHeader {
+    unsigned words[16];
+
+    unsigned width() const { return words[0]; }
+    unsigned height() const { return words[1]; }
+
+    // Words 2-5 hold a NUL-padded text label (operator / scanner identification)
+    std::string label() const {
+        const char* text = reinterpret_cast<const char*>(&words[2]);
+        size_t length = 0;
+        while (length < 4 * sizeof(unsigned) && text[length] != '\0') {
+            ++length;
+        }
+        return std::string(text, length);
+    }
+
+    size_t pixel_bytes() const { return static_cast<size_t>(width()) * height() * sizeof(unsigned); }
+};
+
+// Per-pulse record stored after the pixel data. Observed layout (18 bytes, little-endian, unaligned):
+// 4-character source tag, 2-character record type, 16-bit length, five 16-bit monitor channels.
+const size_t PULSE_RECORD_SIZE = 18;
+const unsigned PULSE_MONITOR_CHANNELS = 5;
+
+struct PulseRecordView {
+    const unsigned char* bytes;
+
+    std::string source() const { return std::string(reinterpret_cast<const char*>(bytes), 4); }
+    std::string type() const { return std::string(reinterpret_cast<const char*>(bytes) + 4, 2); }
+    uint16_t length() const { return read_u16(6); }
+    uint16_t channel(unsigned k) const { return read_u16(8 + 2 * k); }
+
+private:
+    uint16_t read_u16(size_t offset) const {
+        return static_cast<uint16_t>(bytes[offset] | (bytes[offset + 1] << 8));
+    }
+};
+
+// Zero-copy view of the data following the pixels. It is exposed as pulse records when it divides
+// into exactly one record per column (pulse); otherwise only the raw bytes are available.
+class PulseRecords {
+public:
+    PulseRecords() = default;
+    PulseRecords(const unsigned char* data, size_t size, unsigned width) : data(data), bytes(size) {
+        if (width > 0 && size == static_cast<size_t>(width) * PULSE_RECORD_SIZE) {
+            count = width;
+        }
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    PulseRecordView operator[](size_t pulse) const { return {data + pulse * PULSE_RECORD_SIZE}; }
+
+    const unsigned char* raw_data() const { return data; }
+    size_t raw_size() const { return bytes; }
+
+private:
+    const unsigned char* data = nullptr;
+    size_t bytes = 0;
+    size_t count = 0;
+};
+
+// Read-only memory mapping of a whole scan file with typed views of its parts
+class ScanFile {
+public:
+    explicit ScanFile(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error("Error: could not open file " + filename);
+        }
+        size = info.st_size;
+        mapping = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Error: could not map file " + filename);
+        }
+        if (size < sizeof(ScanHeader) || size < sizeof(ScanHeader) + header().pixel_bytes()) {
+            munmap(mapping, size);
+            throw std::runtime_error("Error: unexpected end of file " + filename);
+        }
+        if (header().width() == 0 || header().height() == 0) {
+            munmap(mapping, size);
+            throw std::runtime_error("Error: image dimensions cannot be zero.");
+        }
+    }
+
+    ~ScanFile() { munmap(mapping, size); }
+    ScanFile(const ScanFile&) = delete;
+    ScanFile& operator=(const ScanFile&) = delete;
+
+    const ScanHeader& header() const { return *static_cast<const ScanHeader*>(mapping); }
+    const unsigned* pixels() const { return reinterpret_cast<const unsigned*>(bytes() + sizeof(ScanHeader)); }
+    const unsigned* row(unsigned i) const { return pixels() + static_cast<size_t>(i) * header().width(); }
+    PulseRecords pulses() const {
+        size_t offset = sizeof(ScanHeader) + header().pixel_bytes();
+        return PulseRecords(bytes() + offset, size - offset, header().width());
+    }
+
+private:
+    const unsigned char* bytes() const { return static_cast<const unsigned char*>(mapping); }
+
+    void* mapping;
+    size_t size;
+};
+
+// Function to read width, height and skip the rest of the 16-word header
+void read_header(std::istream& inf, unsigned& height, unsigned& width) {
+    inf.read(reinterpret_cast<char*>(&width), sizeof(unsigned));
+    inf.read(reinterpret_cast<char*>(&height), sizeof(unsigned));
+
+    // Skip the next 14 unsigned integers (header info)
+    inf.seekg(static_cast<unsigned>(inf.tellg()) + sizeof(unsigned) * 14);
+
+    if (height == 0 || width == 0) {
+        throw std::runtime_error("Error: image dimensions cannot be zero.");
+    }
+}
+
+// Function to read a whole scan from a stream, reusing the rows of data when the dimensions match
+void read_data(std::istream& inf, std::vector<std::vector<int>>& data, unsigned& height, unsigned& width) {
+    read_header(inf, height, width);
+
+    if (data.size() != height) {
+        data.resize(height);
+    }
+    unsigned number;
+    for (unsigned i = 0; i < height; ++i) {
+        data[i].resize(width);
+        for (unsigned j = 0; j < width; ++j) {
+            inf.read(reinterpret_cast<char*>(&number), 4);
+            data[i][j] = static_cast<int>(number);
+        }
+    }
+}
+
+// Function to read data from file
+std::vector<std::vector<int>> read_data_from_file(const std::string& filename, unsigned& height, unsigned& width) {
+    std::ifstream inf(filename, std::fstream::in | std::fstream::binary);
+    if (!inf.is_open()) {
+        throw std::runtime_error("Error: could not open file " + filename);
+    }
+
+    std::vector<std::vector<int>> data;
+    read_data(inf, data, height, width);
+    inf.close();
+    return data;
+}
+
+// Background normalization of a single detector line
+template <typename Sample>
+void normalize_background(const Sample* line, std::vector<PixelData>& row, int threshold = SIGNAL_THRESHOLD) {
+    for (unsigned j = 0; j < row.size(); ++j) {
+        int sample = static_cast<int>(line[j]);
+        if (sample > threshold) {
+            row[j].value = sample - threshold;
+        } else {
+            row[j].value = 0;
+        }
+        row[j].is_calibrated = false;
+    }
+}
+
+// Source of the per-pulse (per-column) intensity used by the beta-pulse correction
+enum class DoseSource { BetaThorne, PulseChannel, ReferenceRow };
+
+struct DoseMonitor {
+    DoseSource source = DoseSource::BetaThorne;
+    unsigned index = 0;  // monitor channel for PulseChannel, detector row for ReferenceRow
+};
+
+// Selected with --dose-monitor; the default averages the beta-thorne rows
+DoseMonitor dose_monitor;
+
+// Parses pulse:<channel> or row:<detector row>
+bool parse_dose_monitor(const std::string& spec, DoseMonitor& monitor) {
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon);
+    if (colon == std::string::npos || (kind != "pulse" && kind != "row")) {
+        return false;
+    }
+    std::string index = spec.substr(colon + 1);
+    if (index.empty() || index.size() > 9 || index.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    monitor.source = kind == "pulse" ? DoseSource::PulseChannel : DoseSource::ReferenceRow;
+    monitor.index = std::stoul(index);
+    return true;
+}
+
+// First row of the beta-thorne band and first column of the detector band; -1 selects the
+// standard position (last BETA_THORNE_ROWS_COUNT rows, last MEDIAN_DETECTOR_COUNT columns)
+struct ReferenceRegions {
+    int beta_first_row = -1;
+    int detector_first_column = -1;
+};
+
+void calibrate_processed_data(std::vector<std::vector<PixelData>>& processed_data,
+                              std::vector<double>& median_betathrone, std::vector<double>& median_detector,
+                              const PulseRecords& pulses = PulseRecords(), const ReferenceRegions& regions = ReferenceRegions());
+
+// function to process data into caller-owned rows (reused when the dimensions match)
+void process_data_into(const std::vector<std::vector<int>>& data, std::vector<std::vector<PixelData>>& processed_data) {
+    unsigned m = data.size();
+    unsigned n = data[0].size();
+    if (processed_data.size() != m) {
+        processed_data.resize(m);
+    }
+    // Background normalization
+    for (unsigned i = 0; i < m; ++i) {
+        processed_data[i].resize(n);
+    }
+    scheduler().parallel_for("normalize", m, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            normalize_background(data[i].data(), processed_data[i]);
+        }
+    });
+    std::vector<double> median_betathrone, median_detector;
+    calibrate_processed_data(processed_data, median_betathrone, median_detector);
+}
+
+// function to process data
+std::vector<std::vector<PixelData>> process_data(const std::vector<std::vector<int>>& data) {
+    std::vector<std::vector<PixelData>> processed_data;
+    process_data_into(data, processed_data);
+    return processed_data;
+}
+
+// Per-pulse intensity from a single dose monitor value per column: O(columns) instead of
+// averaging the beta-thorne rows, and unaffected by cargo reaching into those rows.
+void read_dose_monitor(const std::vector<std::vector<PixelData>>& processed_data, const PulseRecords& pulses,
+                       std::vector<double>& pulse_intensity, const DoseMonitor& monitor) {
+    unsigned m = processed_data.size();
+    unsigned n = processed_data[0].size();
+    if (monitor.source == DoseSource::PulseChannel) {
+        if (pulses.size() != n || monitor.index >= PULSE_MONITOR_CHANNELS) {
+            throw std::runtime_error("Error: scan has no per-pulse monitor channel " + std::to_string(monitor.index) + ".");
+        }
+        for (unsigned j = 0; j < n; ++j) {
+            pulse_intensity[j] = pulses[j].channel(monitor.index);
+        }
+    } else {
+        if (monitor.index >= m) {
+            throw std::runtime_error("Error: reference detector row " + std::to_string(monitor.index) + " is outside the scan.");
+        }
+        for (unsigned j = 0; j < n; ++j) {
+            pulse_intensity[j] = processed_data[monitor.index][j].value;
+        }
+    }
+}
+
+// Per-pulse (per-column) intensity of background-normalized data for the beta-pulse correction,
+// into a caller-owned vector; the reference pixels it was measured on are marked as calibrated.
+void measure_beta_pulses(std::vector<std::vector<PixelData>>& processed_data, std::vector<double>& median_betathrone,
+                         const PulseRecords& pulses, const ReferenceRegions& regions, const DoseMonitor& monitor) {
+    unsigned m = processed_data.size();
+    unsigned n = processed_data[0].size();
+    unsigned beta_first = regions.beta_first_row >= 0 ? regions.beta_first_row : m - BETA_THORNE_ROWS_COUNT;
+
+    median_betathrone.assign(n, 0.0);
+    if (monitor.source != DoseSource::BetaThorne) {
+        read_dose_monitor(processed_data, pulses, median_betathrone, monitor);
+        if (monitor.source == DoseSource::ReferenceRow) {
+            for (unsigned j = 0; j < n; ++j) {
+                processed_data[monitor.index][j].is_calibrated = true;
+            }
+        }
+    } else {
+        // Calibration by beta-thorne (last 15 rows unless another band was selected)
+        if (m < BETA_THORNE_ROWS_COUNT || beta_first + BETA_THORNE_ROWS_COUNT > m) {
+            throw std::runtime_error("Error: Not enough rows for beta-thorne calibration.");
+        }
+        scheduler().parallel_for("beta-thorne statistics", n, COLUMN_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; ++j) {
+                double sum = 0.0;
+                for (unsigned i = beta_first; i < beta_first + BETA_THORNE_ROWS_COUNT; ++i) {
+                    sum += processed_data[i][j].value;
+                    processed_data[i][j].is_calibrated = true;
+                }
+                median_betathrone[j] = sum / BETA_THORNE_ROWS_COUNT;
+            }
+        });
+    }
+}
+
+// Scales every uncalibrated pixel by the ratio of the mean pulse intensity to its own pulse's
+void apply_beta_correction(std::vector<std::vector<PixelData>>& processed_data, const std::vector<double>& median_betathrone,
+                           double overall_median) {
+    unsigned m = processed_data.size();
+    unsigned n = processed_data[0].size();
+    scheduler().parallel_for("beta-thorne correction", m, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (unsigned j = 0; j < n; ++j) {
+                if (!processed_data[i][j].is_calibrated) {
+                    if (median_betathrone[j] != 0) {
+                        double proportion = overall_median / median_betathrone[j];
+                        processed_data[i][j].value *= proportion;
+                    }
+                    else{
+                        processed_data[i][j].value = 0.0;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Beta-pulse correction of background-normalized data. The per-column intensities go into a
+// caller-owned scratch vector.
+void correct_beta_pulses(std::vector<std::vector<PixelData>>& processed_data, std::vector<double>& median_betathrone,
+                         const PulseRecords& pulses, const ReferenceRegions& regions, const DoseMonitor& monitor) {
+    measure_beta_pulses(processed_data, median_betathrone, pulses, regions, monitor);
+    double overall_median = std::accumulate(median_betathrone.begin(), median_betathrone.end(), 0.0) / median_betathrone.size();
+    apply_beta_correction(processed_data, median_betathrone, overall_median);
+}
+
+// Detector correction: every row is divided by its mean over the detector reference columns
+// and clamped to 1.0. The per-row means go into a caller-owned scratch vector.
+void correct_detectors(std::vector<std::vector<PixelData>>& processed_data, std::vector<double>& median_detector,
+                       const ReferenceRegions& regions) {
+    unsigned m = processed_data.size();
+    unsigned n = processed_data[0].size();
+    unsigned detector_first = regions.detector_first_column >= 0 ? regions.detector_first_column : n - MEDIAN_DETECTOR_COUNT;
+
+    // Calibration by detectors (last 50 columns unless another band was selected)
+    if (n < MEDIAN_DETECTOR_COUNT || detector_first + MEDIAN_DETECTOR_COUNT > n) {
+         throw std::runtime_error("Error: Not enough columns for detector calibration.");
+    }
+    median_detector.assign(m, 0.0);
+    scheduler().parallel_for("detector calibration", m, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            double sum = 0.0;
+            for (unsigned j = detector_first; j < detector_first + MEDIAN_DETECTOR_COUNT; ++j) {
+                if (!processed_data[i][j].is_calibrated) {
+                    sum += processed_data[i][j].value;
+                    processed_data[i][j].is_calibrated = true;
+                }
+            }
+            median_detector[i] = sum / MEDIAN_DETECTOR_COUNT;
+
+            for (unsigned j = 0; j < n; ++j) {
+                if (!processed_data[i][j].is_calibrated) {
+                    processed_data[i][j].value /= median_detector[i];
+                }
+                if (processed_data[i][j].value > 1.0) {
+                    processed_data[i][j].value = 1.0;
+                }
+            }
+        }
+    });
+}
+
+// Beta-thorne and detector calibration of background-normalized data.
+// The per-column and per-row statistics go into caller-owned scratch vectors.
+void calibrate_processed_data(std::vector<std::vector<PixelData>>& processed_data,
+                              std::vector<double>& median_betathrone, std::vector<double>& median_detector,
+                              const PulseRecords& pulses, const ReferenceRegions& regions) {
+    correct_beta_pulses(processed_data, median_betathrone, pulses, regions, dose_monitor);
+    correct_detectors(processed_data, median_detector, regions);
+}
+
+const unsigned RENDER_STRIP_ROWS = 32;
+
+// Renders rows in strips of RENDER_STRIP_ROWS: the rows of a strip are converted in parallel into
+// the strip buffer, then handed to the writer in order, so no whole-frame RGB image is held.
+template <typename RenderRow>
+void render_in_strips(const std::vector<std::vector<PixelData>>& data, BitmapWriter& writer, FrameBytes& strip,
+                      const char* label, RenderRow render_row) {
+    unsigned m = data.size();
+    unsigned n = data[0].size();
+    size_t widthInBytes = static_cast<size_t>(n) * BYTES_PER_PIXEL;
+    strip.resize(widthInBytes * std::min(m, RENDER_STRIP_ROWS));
+    for (unsigned first = 0; first < m; first += RENDER_STRIP_ROWS) {
+        unsigned rows = std::min(RENDER_STRIP_ROWS, m - first);
+        scheduler().parallel_for(label, rows, 4, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r) {
+                render_row(data[first + r], &strip[r * widthInBytes]);
+            }
+        });
+        for (unsigned r = 0; r < rows; ++r) {
+            writer.write_row(&strip[r * widthInBytes]);
+        }
+    }
+}
+
+void render_normalized_row(const std::vector<PixelData>& data, unsigned char* row) {
+    for (unsigned j = 0; j < data.size(); ++j) {
+        int pixel_index = j * BYTES_PER_PIXEL;
+        if (data[j].is_calibrated) {
+            row[pixel_index + 2] = 255; // Red
+            row[pixel_index + 1] = 0;
+            row[pixel_index + 0] = 0;
+        } else {
+            unsigned char color_value = static_cast<unsigned char>(data[j].value * 255);
+            row[pixel_index + 2] = color_value; // Red
+            row[pixel_index + 1] = color_value; // Green
+            row[pixel_index + 0] = color_value; // Blue
+        }
+    }
+}
+
+const double EMPTY_THICKNESS = 10.0;       // thickness shown where no signal is left
+const double THICKNESS_GREY_LEVELS = 25.0;  // grey levels per unit of thickness
+
+double thickness_of(double v) {
+    return (v > 0.0) ? -std::log(v) : EMPTY_THICKNESS;
+}
+
+unsigned char thickness_grey(double t, double grey_levels) {
+    int iv = static_cast<int>(std::round(t * grey_levels));
+    if (iv < 0) iv = 0;
+    if (iv > 255) iv = 255;
+    return static_cast<unsigned char>(iv);
+}
+
+void render_thickness_row(const std::vector<PixelData>& data, unsigned char* row) {
+    for (unsigned j = 0; j < data.size(); ++j) {
+        int pixel_index = j * BYTES_PER_PIXEL;
+        unsigned char color_value = thickness_grey(thickness_of(data[j].value), THICKNESS_GREY_LEVELS);
+        row[pixel_index + 2] = color_value;
+        row[pixel_index + 1] = color_value;
+        row[pixel_index + 0] = color_value;
+    }
+}
+
+// Renders every row into image (packed BGR rows) for the compressed formats, which encode the
+// whole frame at once
+template <typename RenderRow>
+void render_image(const std::vector<std::vector<PixelData>>& data, FrameBytes& image, const char* label, RenderRow render_row) {
+    size_t widthInBytes = data[0].size() * BYTES_PER_PIXEL;
+    image.resize(widthInBytes * data.size());
+    scheduler().parallel_for(label, data.size(), 4, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            render_row(data[i], &image[i * widthInBytes]);
+        }
+    });
+}
+
+// Renders the calibrated data straight into the BMP writer
+void create_and_save_image(const std::vector<std::vector<PixelData>>& data, const std::string& filename, FrameBytes& strip) {
+    if (format_of(filename) == ImageFormat::Tiff && tiff_options.bits == 16) {
+        save_tiff16(data, filename, [](double v) {
+            return static_cast<uint16_t>(std::round(std::min(std::max(v, 0.0), 1.0) * 65535.0));
+        });
+        return;
+    }
+    if (format_of(filename) != ImageFormat::Bmp) {
+        render_image(data, strip, "render normalized", render_normalized_row);
+        save_rgb_image(strip.data(), data.size(), data[0].size(), filename);
+        return;
+    }
+    BitmapWriter writer(data.size(), data[0].size(), filename.c_str());
+    render_in_strips(data, writer, strip, "render normalized", render_normalized_row);
+    writer.close();
+}
+
+// Function to calculate and save thickness image, strip by strip
+void calculate_and_save_thickness(const std::vector<std::vector<PixelData>>& data, const std::string& filename, FrameBytes& strip) {
+    if (format_of(filename) == ImageFormat::Tiff && tiff_options.bits == 16) {
+        // Same scale as the 8-bit rendering, with 257 steps per grey level
+        save_tiff16(data, filename, [](double v) {
+            return static_cast<uint16_t>(std::min(std::max(std::round(thickness_of(v) * THICKNESS_GREY_LEVELS * 257.0), 0.0), 65535.0));
+        });
+        return;
+    }
+    if (format_of(filename) != ImageFormat::Bmp) {
+        render_image(data, strip, "render thickness", render_thickness_row);
+        save_rgb_image(strip.data(), data.size(), data[0].size(), filename);
+        return;
+    }
+    BitmapWriter writer(data.size(), data[0].size(), filename.c_str());
+    render_in_strips(data, writer, strip, "render thickness", render_thickness_row);
+    writer.close();
+}
+
+void create_and_save_image(const std::vector<std::vector<PixelData>>& data, const std::string& filename) {
+    FrameBytes strip;
+    create_and_save_image(data, filename, strip);
+}
+
+void calculate_and_save_thickness(const std::vector<std::vector<PixelData>>& data, const std::string& filename) {
+    FrameBytes strip;
+    calculate_and_save_thickness(data, filename, strip);
+}
+
+// Every buffer one scan needs from reading to rendering. Reused across scans of the same
+// size, a frame reaches a steady state in which processing performs no heap allocation.
+struct FrameBuffers {
+    ScanHeader header;
+    FrameWords raw;
+    FrameBytes trailing;
+    PulseRecords pulses;  // view of trailing (or of the buffer the scan was parsed from)
+    std::vector<std::vector<int>> data;
+    std::vector<std::vector<PixelData>> processed_data;
+    std::vector<double> median_betathrone;
+    std::vector<double> median_detector;
+    FrameBytes strip;
+    unsigned height = 0;
+    unsigned width = 0;
+    uint64_t cache_key = 0;   // result cache key, computed on first use (0 = not yet)
+    bool calibrated = false;  // processed_data holds this scan's calibration
+};
+
+// Function to spread a row-major payload of frame.height x frame.width samples into frame.data
+void unpack_frame(const unsigned* payload, FrameBuffers& frame) {
+    if (frame.data.size() != frame.height) {
+        frame.data.resize(frame.height);
+    }
+    for (unsigned i = 0; i < frame.height; ++i) {
+        frame.data[i].resize(frame.width);
+    }
+    scheduler().parallel_for("unpack", frame.height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const unsigned* line = &payload[i * frame.width];
+            for (unsigned j = 0; j < frame.width; ++j) {
+                frame.data[i][j] = static_cast<int>(line[j]);
+            }
+        }
+    });
+}
+
+// Function to read a scan into a frame with one read() of the whole payload
+void read_frame(const std::string& filename, FrameBuffers& frame) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Error: could not open file " + filename);
+    }
+    bool complete = ::read(fd, frame.header.words, sizeof(frame.header.words)) == static_cast<ssize_t>(sizeof(frame.header.words));
+    frame.width = frame.header.width();
+    frame.height = frame.header.height();
+    if (complete && (frame.height == 0 || frame.width == 0)) {
+        ::close(fd);
+        throw std::runtime_error("Error: image dimensions cannot be zero.");
+    }
+    if (complete) {
+        frame.raw.resize(static_cast<size_t>(frame.height) * frame.width);
+        size_t remaining = frame.raw.size() * sizeof(unsigned);
+        char* p = reinterpret_cast<char*>(frame.raw.data());
+        ssize_t got;
+        while (remaining > 0 && (got = ::read(fd, p, remaining)) > 0) {
+            p += got;
+            remaining -= got;
+        }
+        complete = remaining == 0;
+    }
+    // Whatever follows the pixels (per-pulse monitor records) is kept alongside the frame
+    struct stat info;
+    if (complete && fstat(fd, &info) == 0) {
+        size_t offset = sizeof(ScanHeader) + frame.header.pixel_bytes();
+        frame.trailing.resize(static_cast<size_t>(info.st_size) > offset ? info.st_size - offset : 0);
+        size_t remaining = frame.trailing.size();
+        char* p = reinterpret_cast<char*>(frame.trailing.data());
+        ssize_t got;
+        while (remaining > 0 && (got = ::read(fd, p, remaining)) > 0) {
+            p += got;
+            remaining -= got;
+        }
+        frame.trailing.resize(frame.trailing.size() - remaining);
+    }
+    ::close(fd);
+    if (!complete) {
+        throw std::runtime_error("Error: unexpected end of file " + filename);
+    }
+    frame.pulses = PulseRecords(frame.trailing.data(), frame.trailing.size(), frame.width);
+    frame.cache_key = 0;
+    frame.calibrated = false;
+
+    unpack_frame(frame.raw.data(), frame);
+}
+
+// Function to parse a scan held in memory (a service RAW payload) into a frame, with the header,
+// pulse records and trailing data read_frame would give for the same bytes on disk
+void parse_frame(const unsigned char* data, size_t size, FrameBuffers& frame) {
+    if (size < sizeof(ScanHeader)) {
+        throw std::runtime_error("Error: RAW payload shorter than its header.");
+    }
+    std::memcpy(frame.header.words, data, sizeof(frame.header.words));
+    frame.width = frame.header.width();
+    frame.height = frame.header.height();
+    if (frame.height == 0 || frame.width == 0) {
+        throw std::runtime_error("Error: image dimensions cannot be zero.");
+    }
+    size_t offset = sizeof(ScanHeader) + frame.header.pixel_bytes();
+    if (size < offset) {
+        throw std::runtime_error("Error: RAW payload shorter than its pixel data.");
+    }
+    frame.raw.resize(static_cast<size_t>(frame.height) * frame.width);
+    std::memcpy(frame.raw.data(), data + sizeof(ScanHeader), frame.header.pixel_bytes());
+    frame.trailing.assign(data + offset, data + size);
+    frame.pulses = PulseRecords(frame.trailing.data(), frame.trailing.size(), frame.width);
+    frame.cache_key = 0;
+    frame.calibrated = false;
+
+    unpack_frame(frame.raw.data(), frame);
+}
+
+// Occlusion-aware reference selection (--reference auto). A band is clean when every detector in it
+// sees an open beam for the pulses it covers: the samples then vary only with pulse intensity, so
+// the coefficient of variation along the pulse (column) direction is small, and no sample is at ADC
+// full scale. Candidate bands are scored with flat per-row sums, and the choice is cached per scanner.
+const unsigned SATURATION_LEVEL = (1u << 20) - 1;
+const unsigned REFERENCE_ROW_STEP = 5;
+const unsigned REFERENCE_COLUMN_STEP = 25;
+const double MAX_REFERENCE_VARIATION = 0.1;
+const double MAX_REFERENCE_SATURATION = 0.001;
+const char* REFERENCE_CACHE_FILE = "reference_regions.cache";
+
+bool reference_auto = false;
+
+struct BandScore {
+    double variation;
+    double saturation;
+};
+
+bool band_is_clean(const BandScore& score) {
+    return score.variation <= MAX_REFERENCE_VARIATION && score.saturation <= MAX_REFERENCE_SATURATION;
+}
+
+// Per-row coefficient of variation over all columns and saturated fraction, used to score row bands
+void row_statistics(const FrameBuffers& frame, std::vector<double>& row_variation, std::vector<double>& row_saturation) {
+    unsigned m = frame.processed_data.size();
+    unsigned n = frame.processed_data[0].size();
+    row_variation.resize(m);
+    row_saturation.resize(m);
+    scheduler().parallel_for("reference row statistics", m, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const PixelData* row = frame.processed_data[i].data();
+            const int* raw = frame.data[i].data();
+            double sum = 0.0, sum_squares = 0.0;
+            unsigned saturated = 0;
+            for (unsigned j = 0; j < n; ++j) {
+                sum += row[j].value;
+                sum_squares += row[j].value * row[j].value;
+                saturated += static_cast<unsigned>(raw[j]) >= SATURATION_LEVEL;
+            }
+            double mean = sum / n;
+            double variance = std::max(0.0, sum_squares / n - mean * mean);
+            row_variation[i] = mean > 0 ? std::sqrt(variance) / mean : std::numeric_limits<double>::infinity();
+            row_saturation[i] = static_cast<double>(saturated) / n;
+        }
+    });
+}
+
+BandScore score_row_band(const std::vector<double>& row_variation, const std::vector<double>& row_saturation, unsigned first) {
+    BandScore score{0.0, 0.0};
+    for (unsigned i = first; i < first + BETA_THORNE_ROWS_COUNT; ++i) {
+        score.variation += row_variation[i] / BETA_THORNE_ROWS_COUNT;
+        score.saturation += row_saturation[i] / BETA_THORNE_ROWS_COUNT;
+    }
+    return score;
+}
+
+// Mean over detectors of the variation across the band's pulses
+BandScore score_column_band(const FrameBuffers& frame, unsigned first) {
+    unsigned m = frame.processed_data.size();
+    double variation = 0.0;
+    unsigned saturated = 0;
+    for (unsigned i = 0; i < m; ++i) {
+        const PixelData* row = frame.processed_data[i].data() + first;
+        const int* raw = frame.data[i].data() + first;
+        double sum = 0.0, sum_squares = 0.0;
+        for (unsigned j = 0; j < MEDIAN_DETECTOR_COUNT; ++j) {
+            sum += row[j].value;
+            sum_squares += row[j].value * row[j].value;
+            saturated += static_cast<unsigned>(raw[j]) >= SATURATION_LEVEL;
+        }
+        double mean = sum / MEDIAN_DETECTOR_COUNT;
+        double variance = std::max(0.0, sum_squares / MEDIAN_DETECTOR_COUNT - mean * mean);
+        variation += mean > 0 ? std::sqrt(variance) / mean : 1.0;
+    }
+    return {variation / m, static_cast<double>(saturated) / (static_cast<double>(m) * MEDIAN_DETECTOR_COUNT)};
+}
+
+// Keeps the standard position while it is clean; only an occluded standard band is replaced, by
+// the cached replacement while that stays clean, or else by the lowest-variation clean candidate
+template <typename Score>
+int pick_band(unsigned extent, unsigned band, unsigned step, Score score, int cached, const char* what) {
+    unsigned standard = extent - band;
+    BandScore standard_score = score(standard);
+    if (band_is_clean(standard_score)) {
+        return standard;
+    }
+    if (cached >= 0 && band_is_clean(score(cached))) {
+        return cached;
+    }
+    BandScore best_score = standard_score;
+    unsigned best = standard;
+    for (unsigned first = 0; first + band <= extent; first += step) {
+        BandScore candidate = score(first);
+        if (candidate.saturation <= MAX_REFERENCE_SATURATION &&
+            (best_score.saturation > MAX_REFERENCE_SATURATION || candidate.variation < best_score.variation)) {
+            best = first;
+            best_score = candidate;
+        }
+    }
+    if (!band_is_clean(best_score)) {
+        std::cerr << "Warning: no unobstructed " << what << " band found, using the cleanest candidate." << std::endl;
+    }
+    return best;
+}
+
+struct CachedRegions {
+    std::string scanner;
+    unsigned height;
+    unsigned width;
+    ReferenceRegions regions;
+};
+
+std::mutex reference_cache_mutex;
+std::vector<CachedRegions> reference_cache;
+bool reference_cache_loaded = false;
+
+void save_reference_cache() {
+    std::ofstream out(REFERENCE_CACHE_FILE, std::ios::trunc);
+    for (const auto& entry : reference_cache) {
+        out << entry.scanner << '\t' << entry.height << '\t' << entry.width << '\t'
+            << entry.regions.beta_first_row << '\t' << entry.regions.detector_first_column << '\n';
+    }
+}
+
+CachedRegions* find_cached_regions(const std::string& scanner, unsigned height, unsigned width) {
+    if (!reference_cache_loaded) {
+        reference_cache_loaded = true;
+        std::ifstream in(REFERENCE_CACHE_FILE);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            CachedRegions entry;
+            // Entries that do not fit their frame (hand-edited or stale) are dropped
+            if (std::getline(fields, entry.scanner, '\t') &&
+                fields >> entry.height >> entry.width >> entry.regions.beta_first_row >> entry.regions.detector_first_column &&
+                entry.height >= BETA_THORNE_ROWS_COUNT && entry.width >= MEDIAN_DETECTOR_COUNT &&
+                entry.regions.beta_first_row >= 0 && entry.regions.beta_first_row <= static_cast<int>(entry.height - BETA_THORNE_ROWS_COUNT) &&
+                entry.regions.detector_first_column >= 0 &&
+                entry.regions.detector_first_column <= static_cast<int>(entry.width - MEDIAN_DETECTOR_COUNT)) {
+                reference_cache.push_back(entry);
+            }
+        }
+    }
+    for (auto& entry : reference_cache) {
+        if (entry.scanner == scanner && entry.height == height && entry.width == width) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// Function to choose the reference bands of a background-normalized frame. Clean standard bands are
+// kept; for an occluded one the cached choice for the scanner is reused while it stays clean, and
+// otherwise every candidate band is scored.
+ReferenceRegions choose_reference_regions(FrameBuffers& frame) {
+    unsigned m = frame.processed_data.size();
+    unsigned n = frame.processed_data[0].size();
+    if (m < BETA_THORNE_ROWS_COUNT || n < MEDIAN_DETECTOR_COUNT) {
+        return ReferenceRegions();
+    }
+    std::vector<double> row_variation, row_saturation;
+    row_statistics(frame, row_variation, row_saturation);
+    auto row_score = [&](unsigned first) { return score_row_band(row_variation, row_saturation, first); };
+    auto column_score = [&](unsigned first) { return score_column_band(frame, first); };
+
+    std::string scanner = frame.header.label();
+    ReferenceRegions previous;
+    {
+        std::lock_guard<std::mutex> lock(reference_cache_mutex);
+        if (CachedRegions* cached = find_cached_regions(scanner, m, n)) {
+            previous = cached->regions;
+        }
+    }
+
+    ReferenceRegions regions;
+    regions.beta_first_row = pick_band(m, BETA_THORNE_ROWS_COUNT, REFERENCE_ROW_STEP, row_score, previous.beta_first_row, "beta-thorne row");
+    regions.detector_first_column = pick_band(n, MEDIAN_DETECTOR_COUNT, REFERENCE_COLUMN_STEP, column_score,
+                                              previous.detector_first_column, "detector column");
+    if (regions.beta_first_row == previous.beta_first_row && regions.detector_first_column == previous.detector_first_column) {
+        return regions;
+    }
+
+    std::lock_guard<std::mutex> lock(reference_cache_mutex);
+    CachedRegions* cached = find_cached_regions(scanner, m, n);
+    if (cached) {
+        cached->regions = regions;
+    } else {
+        reference_cache.push_back({scanner, m, n, regions});
+    }
+    save_reference_cache();
+    return regions;
+}
+
+// Background normalization of frame.data into frame.processed_data
+void normalize_frame(FrameBuffers& frame, int threshold = SIGNAL_THRESHOLD) {
+    unsigned m = frame.data.size();
+    unsigned n = frame.data[0].size();
+    if (frame.processed_data.size() != m) {
+        frame.processed_data.resize(m);
+    }
+    for (unsigned i = 0; i < m; ++i) {
+        frame.processed_data[i].resize(n);
+    }
+    scheduler().parallel_for("normalize", m, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            normalize_background(frame.data[i].data(), frame.processed_data[i], threshold);
+        }
+    });
+}
+
+// Function to calibrate the raw data of a frame into its processed_data
+void process_frame(FrameBuffers& frame) {
+    normalize_frame(frame);
+    ReferenceRegions regions = reference_auto ? choose_reference_regions(frame) : ReferenceRegions();
+    calibrate_processed_data(frame.processed_data, frame.median_betathrone, frame.median_detector, frame.pulses, regions);
+    frame.calibrated = true;
+}
+
+// Thread-safe free list of frames shared by the stages of a pipeline
+class FramePool {
+public:
+    std::unique_ptr<FrameBuffers> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_frames.empty()) {
+            return std::make_unique<FrameBuffers>();
+        }
+        auto frame = std::move(free_frames.back());
+        free_frames.pop_back();
+        return frame;
+    }
+
+    void release(std::unique_ptr<FrameBuffers> frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_frames.push_back(std::move(frame));
+    }
+
+    // Creates frames up front so the pipeline never grows the free list while running
+    void reserve(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_frames.reserve(count);
+        while (free_frames.size() < count) {
+            free_frames.push_back(std::make_unique<FrameBuffers>());
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<FrameBuffers>> free_frames;
+};
+
+// Allocation check: reads, calibrates and renders the same scan repeatedly through one frame and
+// reports the heap allocations of each pass; every pass after the first must be allocation-free.
+#ifdef ALLOC_TEST
+int run_alloc_test(const std::string& filename, int iterations) {
+    FrameBuffers frame;
+    const std::string normalized_output = "alloc_test_normalized.bmp";
+    const std::string thickness_output = "alloc_test_thickness.bmp";
+    bool steady = true;
+    for (int k = 0; k < iterations; ++k) {
+        size_t before = heap_allocation_count.load();
+        read_frame(filename, frame);
+        process_frame(frame);
+        create_and_save_image(frame.processed_data, normalized_output, frame.strip);
+        calculate_and_save_thickness(frame.processed_data, thickness_output, frame.strip);
+        size_t allocations = heap_allocation_count.load() - before;
+        std::cout << "pass " << k + 1 << ": " << allocations << " heap allocations" << std::endl;
+        if (k > 0 && allocations != 0) {
+            steady = false;
+        }
+    }
+    std::cout << (steady ? "OK: steady-state passes are allocation-free" : "FAIL: steady-state passes allocate") << std::endl;
+    return steady ? 0 : 1;
+}
+#else
+int run_alloc_test(const std::string&, int) {
+    throw std::runtime_error("Error: --alloc-test needs a test build (compile with -DALLOC_TEST).");
+}
+#endif
+
+// XXH64 of a byte range (reference algorithm, four independent lanes per 32-byte stripe)
+uint64_t xxh64(const void* data, size_t size, uint64_t seed = 0) {
+    const uint64_t P1 = 11400714785074694791ull, P2 = 14029467366897019727ull, P3 = 1609587929392839161ull;
+    const uint64_t P4 = 9650029242287828579ull, P5 = 2870177450012600261ull;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto read64 = [](const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; };
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        for (uint64_t v : {v1, v2, v3, v4}) {
+            h = (h ^ round(0, v)) * P1 + P4;
+        }
+    } else {
+        h = seed + P5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8) {
+        h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// On-disk cache of scan results (--cache DIR). Entries are addressed by the XXH64 of the raw scan
+// (header, samples and pulse records) and of every setting that changes the calibration, so an
+// identical request is answered by copying files. Each key has a calibrated plane ("<key>.plane")
+// and the rendered images ("<key>_<kind>.<extension>"). Hits refresh an entry's modification time and the
+// least recently used entries are deleted once the directory exceeds its size limit.
+const char PLANE_MAGIC[8] = {'X', 'R', 'A', 'Y', 'P', 'L', 'N', '1'};
+const uint64_t RESULT_CACHE_VERSION = 1;
+const uint64_t DEFAULT_RESULT_CACHE_LIMIT = 1ull << 30;
+
+class ResultCache {
+public:
+    ResultCache(const std::string& directory, uint64_t limit) : directory(directory), limit(limit) {
+        std::filesystem::create_directories(directory);
+    }
+
+    uint64_t key(const FrameBuffers& frame) const {
+        uint64_t settings[] = {RESULT_CACHE_VERSION, static_cast<uint64_t>(dose_monitor.source),
+                               static_cast<uint64_t>(dose_monitor.index), reference_auto};
+        uint64_t hash = xxh64(settings, sizeof(settings));
+        hash = xxh64(frame.header.words, sizeof(frame.header.words), hash);
+        hash = xxh64(frame.raw.data(), frame.raw.size() * sizeof(unsigned), hash);
+        return xxh64(frame.trailing.data(), frame.trailing.size(), hash);
+    }
+
+    bool contains(uint64_t key, const std::string& kind) const {
+        std::error_code error;
+        return std::filesystem::exists(entry_path(key, kind), error);
+    }
+
+    // Copies a cached image to output; false when it is not cached
+    bool fetch(uint64_t key, const std::string& kind, const std::string& output) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::error_code error;
+        std::string path = entry_path(key, kind);
+        std::filesystem::copy_file(path, output, std::filesystem::copy_options::overwrite_existing, error);
+        if (error) {
+            return false;
+        }
+        touch(path);
+        return true;
+    }
+
+    void store(uint64_t key, const std::string& kind, const std::string& output) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string path = entry_path(key, kind);
+        std::error_code error;
+        std::filesystem::copy_file(output, path + ".tmp", std::filesystem::copy_options::overwrite_existing, error);
+        if (!error) {
+            std::filesystem::rename(path + ".tmp", path, error);
+        }
+        evict();
+    }
+
+    bool load_plane(uint64_t key, FrameBuffers& frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string path = entry_path(key, "");
+        std::ifstream in(path, std::ios::binary);
+        char magic[sizeof(PLANE_MAGIC)];
+        unsigned dimensions[2];
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, PLANE_MAGIC, sizeof(magic)) != 0 ||
+            !in.read(reinterpret_cast<char*>(dimensions), sizeof(dimensions)) ||
+            dimensions[0] != frame.height || dimensions[1] != frame.width) {
+            return false;
+        }
+        frame.processed_data.resize(frame.height);
+        std::vector<char>& flags = plane_flags;
+        flags.resize(frame.width);
+        for (auto& row : frame.processed_data) {
+            row.resize(frame.width);
+            for (auto& pixel : row) {
+                in.read(reinterpret_cast<char*>(&pixel.value), sizeof(pixel.value));
+            }
+            in.read(flags.data(), flags.size());
+            for (unsigned j = 0; j < frame.width; ++j) {
+                row[j].is_calibrated = flags[j] != 0;
+            }
+        }
+        if (!in) {
+            return false;
+        }
+        touch(path);
+        return true;
+    }
+
+    // Plane layout: magic, height, width, then per row the values followed by the calibrated flags
+    void store_plane(uint64_t key, const FrameBuffers& frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string path = entry_path(key, "");
+        {
+            std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+            unsigned dimensions[2] = {frame.height, frame.width};
+            out.write(PLANE_MAGIC, sizeof(PLANE_MAGIC));
+            out.write(reinterpret_cast<const char*>(dimensions), sizeof(dimensions));
+            std::vector<char>& flags = plane_flags;
+            flags.resize(frame.width);
+            for (const auto& row : frame.processed_data) {
+                for (unsigned j = 0; j < frame.width; ++j) {
+                    out.write(reinterpret_cast<const char*>(&row[j].value), sizeof(row[j].value));
+                    flags[j] = row[j].is_calibrated;
+                }
+                out.write(flags.data(), flags.size());
+            }
+            if (!out) {
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(path + ".tmp", path, error);
+        evict();
+    }
+
+private:
+    // kind names an image ("normalized.bmp"); an empty kind names the calibrated plane
+    std::string entry_path(uint64_t key, const std::string& kind) const {
+        char name[96];
+        if (!kind.empty()) {
+            snprintf(name, sizeof(name), "%016llx_%s", static_cast<unsigned long long>(key), kind.c_str());
+        } else {
+            snprintf(name, sizeof(name), "%016llx.plane", static_cast<unsigned long long>(key));
+        }
+        return directory + "/" + name;
+    }
+
+    static void touch(const std::string& path) {
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    }
+
+    // Deletes the least recently used entries until the directory fits the limit
+    void evict() {
+        struct Entry {
+            std::filesystem::file_time_type used;
+            uint64_t size;
+            std::filesystem::path path;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code error;
+        for (const auto& item : std::filesystem::directory_iterator(directory, error)) {
+            if (!item.is_regular_file(error) || item.path().extension() == ".tmp") {
+                continue;
+            }
+            Entry entry{item.last_write_time(error), item.file_size(error), item.path()};
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        for (const auto& entry : entries) {
+            if (total <= limit) {
+                break;
+            }
+            std::filesystem::remove(entry.path, error);
+            total -= entry.size;
+        }
+    }
+
+    std::string directory;
+    uint64_t limit;
+    std::mutex mutex;
+    std::vector<char> plane_flags;
+};
+
+std::unique_ptr<ResultCache> result_cache;
+
+uint64_t frame_cache_key(FrameBuffers& frame) {
+    if (frame.cache_key == 0) {
+        frame.cache_key = result_cache->key(frame);
+    }
+    return frame.cache_key;
+}
+
+// Makes frame.processed_data hold the calibration of the frame, from the cache when possible
+void ensure_calibrated(FrameBuffers& frame) {
+    if (frame.calibrated) {
+        return;
+    }
+    if (result_cache && result_cache->load_plane(frame_cache_key(frame), frame)) {
+        frame.calibrated = true;
+        return;
+    }
+    process_frame(frame);
+    if (result_cache) {
+        result_cache->store_plane(frame_cache_key(frame), frame);
+    }
+}
+
+// Cache entry name of an image: its kind and the extension of the output format, plus the TIFF
+// sample depth and compression
+std::string image_entry(const char* kind, ImageFormat format) {
+    std::string entry = kind;
+    if (format == ImageFormat::Tiff) {
+        entry += "." + std::to_string(tiff_options.bits) + (tiff_options.deflate ? "-deflate" : "-none");
+    }
+    return entry + "." + format_extension(format);
+}
+
+// True when every image kind requested for the frame can be copied from the cache
+bool outputs_cached(FrameBuffers& frame, bool with_thickness) {
+    return result_cache && result_cache->contains(frame_cache_key(frame), image_entry("normalized", output_format)) &&
+           (!with_thickness || result_cache->contains(frame_cache_key(frame), image_entry("thickness", output_format)));
+}
+
+using RenderFunction = void (*)(const std::vector<std::vector<PixelData>>&, const std::string&, FrameBytes&);
+
+// Writes one image of a frame, copying it from the cache or rendering (and caching) it
+void save_output(FrameBuffers& frame, const char* kind, const std::string& output, RenderFunction render) {
+    if (result_cache && result_cache->fetch(frame_cache_key(frame), image_entry(kind, format_of(output)), output)) {
+        return;
+    }
+    ensure_calibrated(frame);
+    render(frame.processed_data, output, frame.strip);
+    if (result_cache) {
+        result_cache->store(frame_cache_key(frame), image_entry(kind, format_of(output)), output);
+    }
+}
+
+// Layout of the POSIX shared-memory segment a viewer maps to pick up the latest frame.
+// sequence is a seqlock: odd while the frame is being written, even once it is complete.
+struct SharedFrameHeader {
+    char magic[8];
+    std::atomic<uint64_t> sequence;
+    uint32_t width;
+    uint32_t height;
+    uint64_t value_offset;  // float calibrated values, row-major
+    uint64_t image_offset;  // 8-bit rendered image, row-major, 255 on reference pixels
+    uint64_t segment_size;
+};
+
+const char SHARED_FRAME_MAGIC[8] = {'X', 'R', 'A', 'Y', 'S', 'H', 'M', '1'};
+
+size_t shared_frame_size(unsigned height, unsigned width) {
+    return sizeof(SharedFrameHeader) + static_cast<size_t>(height) * width * (sizeof(float) + 1);
+}
+
+// Function to publish the calibrated plane and its 8-bit rendering into a named shared-memory segment
+void publish_to_shared_memory(const std::vector<std::vector<PixelData>>& data, const std::string& name) {
+    unsigned m = data.size();
+    unsigned n = data[0].size();
+    size_t size = shared_frame_size(m, n);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Error: could not open shared memory " + name + ": " + std::strerror(errno));
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (static_cast<size_t>(info.st_size) < size && ftruncate(fd, size) != 0)) {
+        ::close(fd);
+        throw std::runtime_error("Error: could not size shared memory " + name + ": " + std::strerror(errno));
+    }
+    size = std::max(size, static_cast<size_t>(info.st_size));
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Error: could not map shared memory " + name + ": " + std::strerror(errno));
+    }
+
+    auto* header = static_cast<SharedFrameHeader*>(mapping);
+    uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+    if (std::memcmp(header->magic, SHARED_FRAME_MAGIC, sizeof(SHARED_FRAME_MAGIC)) != 0) {
+        sequence = 0;
+    }
+    sequence |= 1;
+    header->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::memcpy(header->magic, SHARED_FRAME_MAGIC, sizeof(SHARED_FRAME_MAGIC));
+    header->width = n;
+    header->height = m;
+    header->value_offset = sizeof(SharedFrameHeader);
+    header->image_offset = sizeof(SharedFrameHeader) + static_cast<uint64_t>(m) * n * sizeof(float);
+    header->segment_size = size;
+    float* values = reinterpret_cast<float*>(static_cast<char*>(mapping) + header->value_offset);
+    unsigned char* image = static_cast<unsigned char*>(mapping) + header->image_offset;
+    for (unsigned i = 0; i < m; ++i) {
+        for (unsigned j = 0; j < n; ++j) {
+            values[i * n + j] = static_cast<float>(data[i][j].value);
+            image[i * n + j] = data[i][j].is_calibrated ? 255 : static_cast<unsigned char>(data[i][j].value * 255);
+        }
+    }
+
+    header->sequence.store(sequence + 1, std::memory_order_release);
+    munmap(mapping, size);
+}
+
+// Viewer side: copies a consistent frame out of the segment and writes it as a BMP
+int read_shared_memory_frame(const std::string& name, const std::string& output) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SharedFrameHeader)) {
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("Error: no frame published under " + name);
+    }
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Error: could not map shared memory " + name + ": " + std::strerror(errno));
+    }
+    const auto* header = static_cast<const SharedFrameHeader*>(mapping);
+
+    std::vector<unsigned char> image;
+    unsigned m = 0, n = 0;
+    uint64_t sequence = 0;
+    for (bool consistent = false; !consistent; ) {
+        sequence = header->sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        m = header->height;
+        n = header->width;
+        if (header->image_offset + static_cast<uint64_t>(m) * n > static_cast<uint64_t>(info.st_size)) {
+            munmap(mapping, info.st_size);
+            throw std::runtime_error("Error: shared frame header is inconsistent.");
+        }
+        const unsigned char* gray = static_cast<const unsigned char*>(mapping) + header->image_offset;
+        image.resize(static_cast<size_t>(m) * n * BYTES_PER_PIXEL);
+        for (size_t k = 0; k < static_cast<size_t>(m) * n; ++k) {
+            image[k * BYTES_PER_PIXEL + 0] = image[k * BYTES_PER_PIXEL + 1] = image[k * BYTES_PER_PIXEL + 2] = gray[k];
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        consistent = header->sequence.load(std::memory_order_relaxed) == sequence;
+    }
+    munmap(mapping, info.st_size);
+    save_rgb_image(image.data(), m, n, output);
+    std::cout << "Frame " << sequence / 2 << " (" << n << "x" << m << ") written to '" << output << "'." << std::endl;
+    return 0;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Bounded lock-free queue connecting exactly one producer thread with one consumer thread
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : buffer(capacity + 1) {}
+
+    // Blocks (yielding) while the queue is full
+    void push(T item) {
+        size_t tail_index = tail.load(std::memory_order_relaxed);
+        size_t next = (tail_index + 1) % buffer.size();
+        while (next == head.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        buffer[tail_index] = std::move(item);
+        tail.store(next, std::memory_order_release);
+    }
+
+    // Returns false once the queue is closed and drained
+    bool pop(T& item) {
+        size_t head_index = head.load(std::memory_order_relaxed);
+        while (head_index == tail.load(std::memory_order_acquire)) {
+            if (closed.load(std::memory_order_acquire)) {
+                if (head_index == tail.load(std::memory_order_acquire)) {
+                    return false;
+                }
+                break;
+            }
+            std::this_thread::yield();
+        }
+        item = std::move(buffer[head_index]);
+        head.store((head_index + 1) % buffer.size(), std::memory_order_release);
+        return true;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> buffer;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+};
+
+// One scan travelling through the read -> compute -> write pipeline.
+// The frame is borrowed from the batch's FramePool and returned once written.
+struct ScanJob {
+    const std::string* input = nullptr;
+    std::unique_ptr<FrameBuffers> frame;
+    std::string error;
+};
+
+const size_t PIPELINE_QUEUE_CAPACITY = 4;
+
+// Builds "<input without extension>_<suffix>.<format extension>"
+std::string output_path(const std::string& input, const std::string& suffix, ImageFormat format = output_format) {
+    size_t slash = input.find_last_of("/\\");
+    size_t dot = input.find_last_of('.');
+    std::string stem = (dot != std::string::npos && (slash == std::string::npos || dot > slash)) ? input.substr(0, dot) : input;
+    return stem + "_" + suffix + "." + format_extension(format);
+}
+
+// Function to process many scans with reading, calibration and writing overlapped in three threads
+int run_batch(const std::vector<std::string>& inputs, bool with_thickness, const std::string& shm_name) {
+    SpscQueue<ScanJob> read_queue(PIPELINE_QUEUE_CAPACITY);
+    SpscQueue<ScanJob> write_queue(PIPELINE_QUEUE_CAPACITY);
+    // Enough frames for every queue slot plus one in each stage
+    FramePool pool;
+    pool.reserve(2 * (PIPELINE_QUEUE_CAPACITY + 1) + 3);
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread reader([&]() {
+        for (const auto& input : inputs) {
+            ScanJob job;
+            job.input = &input;
+            job.frame = pool.acquire();
+            try {
+                read_frame(input, *job.frame);
+            } catch (const std::exception& e) {
+                job.error = e.what();
+            }
+            read_queue.push(std::move(job));
+        }
+        read_queue.close();
+    });
+
+    std::thread calibrator([&]() {
+        ScanJob job;
+        while (read_queue.pop(job)) {
+            if (job.error.empty()) {
+                try {
+                    if (!shm_name.empty() || !outputs_cached(*job.frame, with_thickness)) {
+                        ensure_calibrated(*job.frame);
+                    }
+                } catch (const std::exception& e) {
+                    job.error = e.what();
+                }
+            }
+            write_queue.push(std::move(job));
+        }
+        write_queue.close();
+    });
+
+    int failures = 0;
+    ScanJob job;
+    while (write_queue.pop(job)) {
+        const std::string& input = *job.input;
+        try {
+            if (!job.error.empty()) {
+                throw std::runtime_error(job.error);
+            }
+            FrameBuffers& frame = *job.frame;
+            bool cached = !frame.calibrated;
+            save_output(frame, "normalized", output_path(input, "normalized"), create_and_save_image);
+            if (with_thickness) {
+                save_output(frame, "thickness", output_path(input, "thickness"), calculate_and_save_thickness);
+            }
+            if (!shm_name.empty()) {
+                publish_to_shared_memory(frame.processed_data, shm_name);
+            }
+            std::cout << input << (cached && !frame.calibrated ? ": done (cached)" : ": done") << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << input << ": " << e.what() << std::endl;
+            ++failures;
+        }
+        pool.release(std::move(job.frame));
+    }
+    reader.join();
+    calibrator.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << inputs.size() << " scans in " << std::fixed << std::setprecision(3) << seconds << " s ("
+              << (seconds > 0 ? inputs.size() / seconds : 0.0) << " scans/s)" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Asynchronous file I/O used by the archive batch executor. Requests complete out of order and
+// are identified by a caller tag; buffer_index selects a registered buffer (-1 = not registered).
+class AsyncFileIo {
+public:
+    virtual ~AsyncFileIo() = default;
+    virtual const char* name() const = 0;
+    // Registers long-lived buffers with the backend; returns false when they are used unregistered
+    virtual bool register_buffers(const std::vector<iovec>& buffers) = 0;
+    virtual void read(int fd, void* buffer, size_t length, uint64_t offset, int buffer_index, uint64_t tag) = 0;
+    virtual void write(int fd, const void* buffer, size_t length, uint64_t offset, int buffer_index, uint64_t tag) = 0;
+    // Waits for one completion; result is the byte count or -errno. Returns false when nothing is in flight.
+    virtual bool wait(uint64_t& tag, long& result) = 0;
+};
+
+// io_uring backend driven through the raw system calls, so no liburing is required
+class UringFileIo : public AsyncFileIo {
+public:
+    explicit UringFileIo(unsigned entries) {
+        io_uring_params params{};
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            throw std::runtime_error("Error: io_uring_setup failed: " + std::string(std::strerror(errno)));
+        }
+        // Kernels before 5.6 set up a ring but fail IORING_OP_READ/WRITE with -EINVAL, so probe for them
+        if (!supports({IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED})) {
+            ::close(ring_fd);
+            throw std::runtime_error("Error: this kernel's io_uring has no read/write operations.");
+        }
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqe_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            ::close(ring_fd);
+            throw std::runtime_error("Error: could not map io_uring queues.");
+        }
+        char* sq = static_cast<char*>(sq_ring);
+        char* cq = static_cast<char*>(cq_ring);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~UringFileIo() override {
+        munmap(sqes, sqe_size);
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_size);
+        }
+        munmap(sq_ring, sq_size);
+        ::close(ring_fd);
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    bool register_buffers(const std::vector<iovec>& buffers) override {
+        registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+        return registered;
+    }
+
+    void read(int fd, void* buffer, size_t length, uint64_t offset, int buffer_index, uint64_t tag) override {
+        submit(registered && buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer, length, offset, buffer_index, tag);
+    }
+
+    void write(int fd, const void* buffer, size_t length, uint64_t offset, int buffer_index, uint64_t tag) override {
+        submit(registered && buffer_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buffer, length, offset, buffer_index, tag);
+    }
+
+    bool wait(uint64_t& tag, long& result) override {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                tag = cqe.user_data;
+                result = cqe.res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                --in_flight;
+                return true;
+            }
+            if (in_flight == 0) {
+                return false;
+            }
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                throw std::runtime_error("Error: io_uring_enter failed: " + std::string(std::strerror(errno)));
+            }
+        }
+    }
+
+private:
+    bool supports(std::initializer_list<int> opcodes) const {
+        std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        for (int opcode : opcodes) {
+            if (opcode > probe->last_op || opcode >= probe->ops_len || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void submit(int opcode, int fd, const void* buffer, size_t length, uint64_t offset, int buffer_index, uint64_t tag) {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.buf_index = buffer_index >= 0 ? buffer_index : 0;
+        sqe.user_data = tag;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) != 1) {
+            throw std::runtime_error("Error: io_uring submission failed: " + std::string(std::strerror(errno)));
+        }
+        ++in_flight;
+    }
+
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    io_uring_sqe* sqes;
+    size_t sq_size, cq_size, sqe_size;
+    unsigned *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned sq_mask, cq_mask;
+    io_uring_cqe* cqes;
+    size_t in_flight = 0;
+    bool registered = false;
+};
+
+// Fallback backend: blocking pread/pwrite on a small thread pool
+class ThreadPoolFileIo : public AsyncFileIo {
+public:
+    explicit ThreadPoolFileIo(unsigned thread_count) {
+        for (unsigned t = 0; t < thread_count; ++t) {
+            threads.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~ThreadPoolFileIo() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        requests_ready.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    const char* name() const override { return "thread pool"; }
+
+    bool register_buffers(const std::vector<iovec>&) override { return false; }
+
+    void read(int fd, void* buffer, size_t length, uint64_t offset, int, uint64_t tag) override {
+        enqueue({false, fd, static_cast<char*>(buffer), length, offset, tag});
+    }
+
+    void write(int fd, const void* buffer, size_t length, uint64_t offset, int, uint64_t tag) override {
+        enqueue({true, fd, const_cast<char*>(static_cast<const char*>(buffer)), length, offset, tag});
+    }
+
+    bool wait(uint64_t& tag, long& result) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (in_flight == 0) {
+            return false;
+        }
+        completions_ready.wait(lock, [&]() { return !completions.empty(); });
+        tag = completions.front().first;
+        result = completions.front().second;
+        completions.pop_front();
+        --in_flight;
+        return true;
+    }
+
+private:
+    struct Request {
+        bool is_write;
+        int fd;
+        char* buffer;
+        size_t length;
+        uint64_t offset;
+        uint64_t tag;
+    };
+
+    void enqueue(const Request& request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+            ++in_flight;
+        }
+        requests_ready.notify_one();
+    }
+
+    void worker_loop() {
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                requests_ready.wait(lock, [&]() { return stopping || !requests.empty(); });
+                if (requests.empty()) {
+                    return;
+                }
+                request = requests.front();
+                requests.pop_front();
+            }
+            ssize_t done = request.is_write ? ::pwrite(request.fd, request.buffer, request.length, request.offset)
+                                            : ::pread(request.fd, request.buffer, request.length, request.offset);
+            long result = done < 0 ? -errno : done;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                completions.emplace_back(request.tag, result);
+            }
+            completions_ready.notify_one();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable requests_ready;
+    std::condition_variable completions_ready;
+    std::deque<Request> requests;
+    std::deque<std::pair<uint64_t, long>> completions;
+    std::vector<std::thread> threads;
+    size_t in_flight = 0;
+    bool stopping = false;
+};
+
+const unsigned IO_SLOT_COUNT = 4;
+const unsigned IO_THREAD_COUNT = 4;
+const unsigned URING_ENTRIES = 64;
+
+std::unique_ptr<AsyncFileIo> make_async_io(bool prefer_uring) {
+    if (prefer_uring) {
+        try {
+            return std::make_unique<UringFileIo>(URING_ENTRIES);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << " Falling back to blocking I/O on a thread pool." << std::endl;
+        }
+    }
+    return std::make_unique<ThreadPoolFileIo>(IO_THREAD_COUNT);
+}
+
+// One in-flight scan of the async batch: its input bytes and encoded outputs live in buffers
+// registered with the I/O backend once, for the whole batch.
+struct IoSlot {
+    enum { INPUT, NORMALIZED, THICKNESS, BUFFER_COUNT };
+    FrameBytes buffers[BUFFER_COUNT];
+    int fds[BUFFER_COUNT] = {-1, -1, -1};
+    size_t lengths[BUFFER_COUNT] = {0, 0, 0};
+    size_t done[BUFFER_COUNT] = {0, 0, 0};
+    size_t scan = 0;
+    int writes_pending = 0;
+    bool failed = false;
+};
+
+// Batch executor for large archives: reads of upcoming scans and writes of finished outputs are
+// submitted asynchronously while the calling thread calibrates and encodes the scan that just arrived.
+int run_async_batch(const std::vector<std::string>& inputs, bool with_thickness, bool prefer_uring, const std::string& shm_name) {
+    // Size the slot buffers from the headers, so they can be registered once up front
+    size_t input_capacity = 0, output_capacity = 0;
+    for (const auto& input : inputs) {
+        int fd = ::open(input.c_str(), O_RDONLY);
+        unsigned header[2] = {0, 0};
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && ::pread(fd, header, sizeof(header), 0) == sizeof(header)) {
+            input_capacity = std::max(input_capacity, static_cast<size_t>(info.st_size));
+            output_capacity = std::max(output_capacity, BitmapWriter::file_size(header[1], header[0]));
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    // Round up to whole words, since the payload is reinterpreted as 32-bit samples
+    input_capacity = (input_capacity + sizeof(unsigned) - 1) / sizeof(unsigned) * sizeof(unsigned);
+
+    auto io = make_async_io(prefer_uring);
+    std::vector<IoSlot> slots(std::min<size_t>(IO_SLOT_COUNT, std::max<size_t>(inputs.size(), 1)));
+    std::vector<iovec> registered;
+    for (auto& slot : slots) {
+        slot.buffers[IoSlot::INPUT].resize(std::max<size_t>(input_capacity, 1));
+        slot.buffers[IoSlot::NORMALIZED].resize(std::max<size_t>(output_capacity, 1));
+        slot.buffers[IoSlot::THICKNESS].resize(with_thickness ? std::max<size_t>(output_capacity, 1) : 1);
+        for (auto& buffer : slot.buffers) {
+            registered.push_back({buffer.data(), buffer.size()});
+        }
+    }
+    bool fixed = io->register_buffers(registered);
+    std::cout << "I/O backend: " << io->name() << (fixed ? " with registered buffers" : "") << std::endl;
+
+    FrameBuffers frame;
+    int failures = 0;
+    size_t next = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto tag_of = [](size_t slot, int kind) { return static_cast<uint64_t>(slot) * IoSlot::BUFFER_COUNT + kind; };
+    auto buffer_index = [](size_t slot, int kind) { return static_cast<int>(slot * IoSlot::BUFFER_COUNT + kind); };
+
+    auto fail = [&](IoSlot& slot, const std::string& message) {
+        std::cerr << inputs[slot.scan] << ": " << message << std::endl;
+        ++failures;
+    };
+
+    // Opens the next readable scan and submits its read into the slot
+    auto start_read = [&](size_t index) {
+        IoSlot& slot = slots[index];
+        while (next < inputs.size()) {
+            slot.scan = next++;
+            slot.failed = false;
+            int fd = ::open(inputs[slot.scan].c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) > input_capacity) {
+                if (fd >= 0) ::close(fd);
+                fail(slot, "Error: could not open file " + inputs[slot.scan]);
+                continue;
+            }
+            slot.fds[IoSlot::INPUT] = fd;
+            slot.lengths[IoSlot::INPUT] = info.st_size;
+            slot.done[IoSlot::INPUT] = 0;
+            io->read(fd, slot.buffers[IoSlot::INPUT].data(), info.st_size, 0, buffer_index(index, IoSlot::INPUT), tag_of(index, IoSlot::INPUT));
+            return;
+        }
+    };
+
+    auto start_write = [&](size_t index, int kind, const std::string& path) {
+        IoSlot& slot = slots[index];
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Error: could not create file " + path);
+        }
+        slot.fds[kind] = fd;
+        slot.done[kind] = 0;
+        ++slot.writes_pending;
+        io->write(fd, slot.buffers[kind].data(), slot.lengths[kind], 0, buffer_index(index, kind), tag_of(index, kind));
+    };
+
+    // Calibrates and encodes a scan whose bytes are in the slot's input buffer, then submits its writes
+    auto process_slot = [&](size_t index) {
+        IoSlot& slot = slots[index];
+        const unsigned* words = reinterpret_cast<const unsigned*>(slot.buffers[IoSlot::INPUT].data());
+        size_t length = slot.lengths[IoSlot::INPUT];
+        if (length < 16 * sizeof(unsigned)) {
+            throw std::runtime_error("Error: unexpected end of file " + inputs[slot.scan]);
+        }
+        std::memcpy(frame.header.words, words, sizeof(frame.header.words));
+        frame.width = frame.header.width();
+        frame.height = frame.header.height();
+        if (frame.height == 0 || frame.width == 0) {
+            throw std::runtime_error("Error: image dimensions cannot be zero.");
+        }
+        size_t pixels_end = sizeof(ScanHeader) + frame.header.pixel_bytes();
+        if (length < pixels_end) {
+            throw std::runtime_error("Error: unexpected end of file " + inputs[slot.scan]);
+        }
+        frame.pulses = PulseRecords(slot.buffers[IoSlot::INPUT].data() + pixels_end, length - pixels_end, frame.width);
+        unpack_frame(words + 16, frame);
+        process_frame(frame);
+
+        BitmapWriter normalized(frame.height, frame.width, slot.buffers[IoSlot::NORMALIZED].data(), slot.buffers[IoSlot::NORMALIZED].size());
+        render_in_strips(frame.processed_data, normalized, frame.strip, "render normalized", render_normalized_row);
+        slot.lengths[IoSlot::NORMALIZED] = normalized.size();
+        if (with_thickness) {
+            BitmapWriter thickness(frame.height, frame.width, slot.buffers[IoSlot::THICKNESS].data(), slot.buffers[IoSlot::THICKNESS].size());
+            render_in_strips(frame.processed_data, thickness, frame.strip, "render thickness", render_thickness_row);
+            slot.lengths[IoSlot::THICKNESS] = thickness.size();
+        }
+        if (!shm_name.empty()) {
+            publish_to_shared_memory(frame.processed_data, shm_name);
+        }
+        start_write(index, IoSlot::NORMALIZED, output_path(inputs[slot.scan], "normalized", ImageFormat::Bmp));
+        if (with_thickness) {
+            start_write(index, IoSlot::THICKNESS, output_path(inputs[slot.scan], "thickness", ImageFormat::Bmp));
+        }
+    };
+
+    for (size_t index = 0; index < slots.size(); ++index) {
+        start_read(index);
+    }
+
+    uint64_t tag;
+    long result;
+    while (io->wait(tag, result)) {
+        size_t index = tag / IoSlot::BUFFER_COUNT;
+        int kind = tag % IoSlot::BUFFER_COUNT;
+        IoSlot& slot = slots[index];
+        if (result > 0 && slot.done[kind] + result < slot.lengths[kind]) {
+            // Short transfer: continue where it stopped
+            slot.done[kind] += result;
+            char* base = reinterpret_cast<char*>(slot.buffers[kind].data()) + slot.done[kind];
+            size_t remaining = slot.lengths[kind] - slot.done[kind];
+            if (kind == IoSlot::INPUT) {
+                io->read(slot.fds[kind], base, remaining, slot.done[kind], -1, tag);
+            } else {
+                io->write(slot.fds[kind], base, remaining, slot.done[kind], -1, tag);
+            }
+            continue;
+        }
+        bool ok = result >= 0 && slot.done[kind] + result == slot.lengths[kind];
+        ::close(slot.fds[kind]);
+        slot.fds[kind] = -1;
+
+        if (kind == IoSlot::INPUT) {
+            if (!ok) {
+                fail(slot, "Error: could not read file " + inputs[slot.scan]);
+                start_read(index);
+                continue;
+            }
+            try {
+                process_slot(index);
+            } catch (const std::exception& e) {
+                fail(slot, e.what());
+                slot.failed = true;
+            }
+            if (slot.writes_pending == 0) {
+                start_read(index);
+            }
+            continue;
+        }
+
+        if (!ok && !slot.failed) {
+            fail(slot, "Error: failed to write output.");
+            slot.failed = true;
+        }
+        if (--slot.writes_pending == 0) {
+            if (!slot.failed) {
+                std::cout << inputs[slot.scan] << ": done" << std::endl;
+            }
+            start_read(index);
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << inputs.size() << " scans in " << std::fixed << std::setprecision(3) << seconds << " s ("
+              << (seconds > 0 ? inputs.size() / seconds : 0.0) << " scans/s)" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// 64-bit FNV-1a, used to fingerprint the non-pixel content of scan files
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 1469598103934665603ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < size; ++k) {
+        hash = (hash ^ bytes[k]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// One fixed-size record of the scan catalog; path_offset points into the string table that follows
+struct CatalogEntry {
+    ScanHeader header;
+    uint64_t file_size;
+    int64_t modified;  // file modification time, seconds since the epoch
+    uint64_t content_hash;  // FNV-1a of the header and the trailing data after the pixels
+    uint32_t path_offset;
+    uint32_t path_length;
+};
+
+const char CATALOG_MAGIC[8] = {'X', 'R', 'A', 'Y', 'I', 'D', 'X', '1'};
+
+bool catalog_order(const CatalogEntry& a, const CatalogEntry& b) {
+    if (a.header.width() != b.header.width()) return a.header.width() < b.header.width();
+    if (a.header.height() != b.header.height()) return a.header.height() < b.header.height();
+    return a.modified < b.modified;
+}
+
+// Reads only the header and the trailing data of one scan file; pixel data is never touched
+bool read_catalog_entry(const std::string& path, CatalogEntry& entry) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0 && ::pread(fd, entry.header.words, sizeof(entry.header.words), 0) == sizeof(entry.header.words);
+    if (ok) {
+        entry.file_size = info.st_size;
+        entry.modified = info.st_mtime;
+        entry.content_hash = fnv1a(entry.header.words, sizeof(entry.header.words));
+        uint64_t trailing_offset = sizeof(entry.header.words) + entry.header.pixel_bytes();
+        char buffer[64 * 1024];
+        for (uint64_t offset = trailing_offset; offset < entry.file_size; ) {
+            ssize_t got = ::pread(fd, buffer, sizeof(buffer), offset);
+            if (got <= 0) {
+                break;
+            }
+            entry.content_hash = fnv1a(buffer, got, entry.content_hash);
+            offset += got;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Builds a sorted catalog of every *.int file under the given files/directories, reading headers in parallel
+int build_catalog(const std::string& index_path, const std::vector<std::string>& roots) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> paths;
+    for (const auto& root : roots) {
+        std::error_code error;
+        if (std::filesystem::is_directory(root, error)) {
+            for (auto it = std::filesystem::recursive_directory_iterator(root, error); it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+                if (it->is_regular_file(error) && it->path().extension() == ".int") {
+                    paths.push_back(it->path().string());
+                }
+            }
+        } else {
+            paths.push_back(root);
+        }
+    }
+
+    std::vector<CatalogEntry> entries(paths.size());
+    std::vector<char> valid(paths.size(), 0);
+    scheduler().parallel_for("catalog headers", paths.size(), 8, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            valid[k] = read_catalog_entry(paths[k], entries[k]);
+        }
+    });
+
+    std::string strings;
+    std::vector<CatalogEntry> kept;
+    for (size_t k = 0; k < paths.size(); ++k) {
+        if (!valid[k]) {
+            std::cerr << paths[k] << ": skipped (no readable header)" << std::endl;
+            continue;
+        }
+        entries[k].path_offset = strings.size();
+        entries[k].path_length = paths[k].size();
+        strings += paths[k];
+        kept.push_back(entries[k]);
+    }
+    std::sort(kept.begin(), kept.end(), catalog_order);
+
+    std::ofstream out(index_path, std::ios::binary | std::ios::trunc);
+    uint64_t count = kept.size();
+    out.write(CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(kept.data()), kept.size() * sizeof(CatalogEntry));
+    out.write(strings.data(), strings.size());
+    if (!out) {
+        throw std::runtime_error("Error: could not write index " + index_path);
+    }
+    std::cout << "Indexed " << kept.size() << " scans in " << std::fixed << std::setprecision(3)
+              << elapsed_ms(start) << " ms -> " << index_path << std::endl;
+    return 0;
+}
+
+// Query over a memory-mapped catalog: binary search on dimensions, then filters on the matching range
+struct CatalogQuery {
+    unsigned width = 0;
+    unsigned height = 0;
+    std::string label;
+    int64_t since = 0;
+    int64_t until = 0;  // end of the last day included (exclusive), 0 = no limit
+};
+
+const int64_t SECONDS_PER_DAY = 24 * 60 * 60;
+
+int64_t parse_date(const std::string& text) {
+    std::tm date{};
+    std::istringstream parse(text);
+    parse >> std::get_time(&date, "%Y-%m-%d");
+    if (parse.fail()) {
+        throw std::runtime_error("Error: dates must be YYYY-MM-DD, got " + text);
+    }
+    return timegm(&date);
+}
+
+int query_catalog(const std::string& index_path, const CatalogQuery& query) {
+    int fd = ::open(index_path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CATALOG_MAGIC) + sizeof(uint64_t)) {
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("Error: could not open index " + index_path);
+    }
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Error: could not map index " + index_path);
+    }
+    const char* base = static_cast<const char*>(mapping);
+    uint64_t count;
+    std::memcpy(&count, base + sizeof(CATALOG_MAGIC), sizeof(count));
+    uint64_t body = info.st_size - sizeof(CATALOG_MAGIC) - sizeof(count);
+    if (std::memcmp(base, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 || count > body / sizeof(CatalogEntry)) {
+        munmap(mapping, info.st_size);
+        throw std::runtime_error("Error: " + index_path + " is not a scan catalog.");
+    }
+    const CatalogEntry* first = reinterpret_cast<const CatalogEntry*>(base + sizeof(CATALOG_MAGIC) + sizeof(count));
+    const char* strings = reinterpret_cast<const char*>(first + count);
+    uint64_t strings_size = body - count * sizeof(CatalogEntry);
+
+    auto start = std::chrono::steady_clock::now();
+    const CatalogEntry* begin = first;
+    const CatalogEntry* end = first + count;
+    if (query.width) {
+        auto by_width = [](const CatalogEntry& entry, unsigned width) { return entry.header.width() < width; };
+        auto width_above = [](unsigned width, const CatalogEntry& entry) { return width < entry.header.width(); };
+        begin = std::lower_bound(begin, end, query.width, by_width);
+        end = std::upper_bound(begin, end, query.width, width_above);
+        if (query.height) {
+            auto by_height = [](const CatalogEntry& entry, unsigned height) { return entry.header.height() < height; };
+            auto height_above = [](unsigned height, const CatalogEntry& entry) { return height < entry.header.height(); };
+            begin = std::lower_bound(begin, end, query.height, by_height);
+            end = std::upper_bound(begin, end, query.height, height_above);
+        }
+    }
+    std::vector<const CatalogEntry*> matches;
+    for (const CatalogEntry* entry = begin; entry != end; ++entry) {
+        if ((query.height && entry->header.height() != query.height) ||
+            (!query.label.empty() && entry->header.label() != query.label) ||
+            (query.since && entry->modified < query.since) ||
+            (query.until && entry->modified >= query.until)) {
+            continue;
+        }
+        matches.push_back(entry);
+    }
+    double query_us = elapsed_ms(start) * 1e3;
+
+    for (const CatalogEntry* entry : matches) {
+        if (entry->path_offset > strings_size || entry->path_length > strings_size - entry->path_offset) {
+            munmap(mapping, info.st_size);
+            throw std::runtime_error("Error: " + index_path + " is corrupt (path outside the index).");
+        }
+    }
+    for (const CatalogEntry* entry : matches) {
+        char date[32];
+        time_t modified = entry->modified;
+        std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", std::gmtime(&modified));
+        std::cout << std::string(strings + entry->path_offset, entry->path_length)
+                  << "  " << entry->header.width() << "x" << entry->header.height()
+                  << "  label='" << entry->header.label() << "'  " << date
+                  << "  size=" << entry->file_size
+                  << "  hash=" << std::hex << std::setw(16) << std::setfill('0') << entry->content_hash << std::dec << std::setfill(' ') << std::endl;
+    }
+    std::cout << matches.size() << " of " << count << " scans matched in " << std::fixed << std::setprecision(1) << query_us << " us" << std::endl;
+    munmap(mapping, info.st_size);
+    return 0;
+}
+
+// Prints the structured content of a scan file: header words, dimensions and the trailing records
+int inspect_scan(const std::string& filename) {
+    ScanFile scan(filename);
+    const ScanHeader& header = scan.header();
+    std::cout << filename << ": " << header.width() << "x" << header.height() << ", label '" << header.label() << "'" << std::endl;
+    std::cout << "header words:";
+    for (unsigned k = 0; k < 16; ++k) {
+        std::cout << " " << std::hex << std::setw(8) << std::setfill('0') << header.words[k];
+    }
+    std::cout << std::dec << std::setfill(' ') << std::endl;
+
+    PulseRecords pulses = scan.pulses();
+    std::cout << "trailing data: " << pulses.raw_size() << " bytes";
+    if (pulses.empty()) {
+        std::cout << " (not in per-pulse record layout)" << std::endl;
+        return 0;
+    }
+    std::cout << ", " << pulses.size() << " pulse records" << std::endl;
+
+    std::vector<std::pair<std::string, size_t>> kinds;
+    for (size_t pulse = 0; pulse < pulses.size(); ++pulse) {
+        std::string kind = pulses[pulse].source() + "/" + pulses[pulse].type() + "/" + std::to_string(pulses[pulse].length());
+        auto it = std::find_if(kinds.begin(), kinds.end(), [&](const auto& known) { return known.first == kind; });
+        if (it == kinds.end()) {
+            kinds.emplace_back(kind, 1);
+        } else {
+            ++it->second;
+        }
+    }
+    for (const auto& kind : kinds) {
+        std::cout << "  records " << kind.first << ": " << kind.second << std::endl;
+    }
+    for (unsigned k = 0; k < PULSE_MONITOR_CHANNELS; ++k) {
+        unsigned low = 65535, high = 0;
+        double sum = 0.0;
+        for (size_t pulse = 0; pulse < pulses.size(); ++pulse) {
+            unsigned value = pulses[pulse].channel(k);
+            low = std::min(low, value);
+            high = std::max(high, value);
+            sum += value;
+        }
+        std::cout << "  channel " << k << ": min " << low << ", mean " << std::fixed << std::setprecision(1)
+                  << sum / pulses.size() << ", max " << high << std::endl;
+    }
+    return 0;
+}
+
+// Parses a non-negative count given for a command-line option
+unsigned long parse_count(const std::string& text, const std::string& option) {
+    if (text.empty() || text.size() > 9 || text.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::runtime_error("Error: " + option + " expects a number, got '" + text + "'.");
+    }
+    return std::stoul(text);
+}
+
+// Numbers of a sysfs list such as "0-3,8,10-11"
+std::vector<int> parse_sysfs_list(std::istream& list) {
+    std::vector<int> numbers;
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        int first = 0, last = -1;
+        char dash;
+        std::istringstream parse(range);
+        if (parse >> first) {
+            last = (parse >> dash >> last) ? last : first;
+        }
+        for (int number = first; number <= last; ++number) {
+            numbers.push_back(number);
+        }
+    }
+    return numbers;
+}
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// Online NUMA nodes and their CPUs as listed in sysfs (node IDs may be sparse); a single node with
+// every CPU when sysfs has no topology
+std::vector<NumaNode> numa_node_cpus() {
+    std::vector<NumaNode> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    for (int node : parse_sysfs_list(online)) {
+        std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::vector<int> cpus = parse_sysfs_list(list);
+        if (!cpus.empty()) {
+            nodes.push_back({node, cpus});
+        }
+    }
+    if (nodes.empty()) {
+        unsigned count = std::max(1u, std::thread::hardware_concurrency());
+        nodes.push_back({0, {}});
+        for (unsigned cpu = 0; cpu < count; ++cpu) {
+            nodes.back().cpus.push_back(cpu);
+        }
+    }
+    return nodes;
+}
+
+void pin_current_thread(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+enum class NodePolicy { RoundRobin, LeastLoaded };
+
+// Queue of scan indices waiting for one node's workers
+struct NodeQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<size_t> scans;
+    size_t pending = 0;  // queued or in progress, guarded by the dispatcher's mutex
+    size_t workers = 0;
+    bool closed = false;
+};
+
+// Batch executor with one worker pool per NUMA node. Workers are pinned to their node and
+// allocate their frame after pinning, so first touch places every frame page on the node that
+// reads, calibrates and writes it. Round-robin deals the scans out up front; least-loaded hands
+// each scan out only when a node has an idle worker, to the node with the fewest scans per worker.
+int run_numa_batch(const std::vector<std::string>& inputs, bool with_thickness, NodePolicy policy,
+                   unsigned workers_per_node, size_t node_limit, bool quiet) {
+    auto nodes = numa_node_cpus();
+    if (node_limit > 0 && nodes.size() > node_limit) {
+        nodes.resize(node_limit);
+    }
+    std::vector<NodeQueue> queues(nodes.size());
+    std::mutex dispatch_mutex;
+    std::condition_variable worker_idle;
+    std::atomic<int> failures{0};
+    std::mutex output_mutex;
+    auto start = std::chrono::steady_clock::now();
+
+    // Each node gets its own pinned scheduler for the data-parallel stages of its scans, so calibration
+    // and rendering bands never leave the node either
+    std::vector<std::unique_ptr<TaskScheduler>> node_schedulers;
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        node_schedulers.push_back(std::make_unique<TaskScheduler>(nodes[node].cpus.size(), [&nodes, node]() { pin_current_thread(nodes[node].cpus); }));
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        unsigned count = workers_per_node ? workers_per_node : nodes[node].cpus.size();
+        queues[node].workers = count;
+        for (unsigned w = 0; w < count; ++w) {
+            workers.emplace_back([&, node]() {
+                pin_current_thread(nodes[node].cpus);
+                node_schedulers[node]->route_current_thread();
+                FrameBuffers frame;
+                NodeQueue& queue = queues[node];
+                while (true) {
+                    size_t index;
+                    {
+                        std::unique_lock<std::mutex> lock(queue.mutex);
+                        queue.ready.wait(lock, [&]() { return queue.closed || !queue.scans.empty(); });
+                        if (queue.scans.empty()) {
+                            return;
+                        }
+                        index = queue.scans.front();
+                        queue.scans.pop_front();
+                    }
+                    const std::string& input = inputs[index];
+                    try {
+                        read_frame(input, frame);
+                        process_frame(frame);
+                        create_and_save_image(frame.processed_data, quiet ? "/dev/null" : output_path(input, "normalized"), frame.strip);
+                        if (with_thickness) {
+                            calculate_and_save_thickness(frame.processed_data, quiet ? "/dev/null" : output_path(input, "thickness"), frame.strip);
+                        }
+                        if (!quiet) {
+                            std::lock_guard<std::mutex> lock(output_mutex);
+                            std::cout << input << ": done on node " << nodes[node].id << std::endl;
+                        }
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cerr << input << ": " << e.what() << std::endl;
+                        ++failures;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(dispatch_mutex);
+                        --queue.pending;
+                    }
+                    worker_idle.notify_one();
+                }
+            });
+        }
+    }
+
+    for (size_t index = 0; index < inputs.size(); ++index) {
+        size_t node = index % nodes.size();
+        if (policy == NodePolicy::LeastLoaded) {
+            std::unique_lock<std::mutex> lock(dispatch_mutex);
+            auto has_idle_worker = [&](size_t candidate) { return queues[candidate].pending < queues[candidate].workers; };
+            worker_idle.wait(lock, [&]() {
+                for (size_t candidate = 0; candidate < nodes.size(); ++candidate) {
+                    if (has_idle_worker(candidate)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+            auto load = [&](size_t candidate) { return static_cast<double>(queues[candidate].pending) / queues[candidate].workers; };
+            node = nodes.size();
+            for (size_t candidate = 0; candidate < nodes.size(); ++candidate) {
+                if (has_idle_worker(candidate) && (node == nodes.size() || load(candidate) < load(node))) {
+                    node = candidate;
+                }
+            }
+            ++queues[node].pending;
+        } else {
+            std::lock_guard<std::mutex> lock(dispatch_mutex);
+            ++queues[node].pending;
+        }
+        std::lock_guard<std::mutex> lock(queues[node].mutex);
+        queues[node].scans.push_back(index);
+        queues[node].ready.notify_one();
+    }
+    for (auto& queue : queues) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.closed = true;
+        queue.ready.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << inputs.size() << " scans on " << nodes.size() << " node(s), " << workers.size() << " workers in "
+              << std::fixed << std::setprecision(3) << seconds << " s ("
+              << (seconds > 0 ? inputs.size() / seconds : 0.0) << " scans/s)" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Cross-socket scaling benchmark: the same scan processed repeatedly on one node, then on all nodes
+int run_numa_bench(const std::string& filename, size_t scans) {
+    auto nodes = numa_node_cpus();
+    std::cout << nodes.size() << " NUMA node(s):";
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        std::cout << " node" << nodes[node].id << "=" << nodes[node].cpus.size() << " cpu(s)";
+    }
+    std::cout << std::endl;
+    std::vector<std::string> inputs(scans, filename);
+    int status = 0;
+    std::vector<size_t> node_counts = {1};
+    if (nodes.size() > 1) {
+        node_counts.push_back(nodes.size());
+    }
+    for (size_t node_count : node_counts) {
+        std::cout << "nodes=" << node_count << ": ";
+        status |= run_numa_batch(inputs, true, NodePolicy::LeastLoaded, 0, node_count, true);
+    }
+    return status;
+}
+
+// Fixed-capacity single-producer/single-consumer ring of preallocated detector lines.
+// The producer fills a slot in place and publishes it; no allocation happens after construction.
+class LineRing {
+public:
+    LineRing(size_t capacity, unsigned line_width)
+        : slots(capacity + 1, std::vector<unsigned>(line_width)), width(line_width) {}
+
+    unsigned line_width() const { return width; }
+
+    // Producer: returns the next free slot, or nullptr when the consumer is behind
+    unsigned* try_acquire() {
+        size_t tail_index = tail.load(std::memory_order_relaxed);
+        if ((tail_index + 1) % slots.size() == head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return slots[tail_index].data();
+    }
+
+    // Producer: waits for a free slot, recording how often and how long it was blocked
+    unsigned* acquire() {
+        unsigned* slot = try_acquire();
+        if (slot) {
+            return slot;
+        }
+        ++full_events;
+        auto blocked_since = std::chrono::steady_clock::now();
+        while (!(slot = try_acquire())) {
+            std::this_thread::yield();
+        }
+        blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - blocked_since).count();
+        return slot;
+    }
+
+    // Producer: makes the slot returned by acquire() visible to the consumer
+    void publish() {
+        size_t tail_index = tail.load(std::memory_order_relaxed);
+        size_t next = (tail_index + 1) % slots.size();
+        tail.store(next, std::memory_order_release);
+        size_t occupancy = (next + slots.size() - head.load(std::memory_order_acquire)) % slots.size();
+        if (occupancy > max_occupancy) {
+            max_occupancy = occupancy;
+        }
+        ++pushed;
+    }
+
+    // Consumer: returns the oldest published line, or nullptr once closed and drained
+    const unsigned* front() {
+        size_t head_index = head.load(std::memory_order_relaxed);
+        while (head_index == tail.load(std::memory_order_acquire)) {
+            if (closed.load(std::memory_order_acquire) && head_index == tail.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            std::this_thread::yield();
+        }
+        return slots[head_index].data();
+    }
+
+    // Consumer: hands the slot returned by front() back to the producer
+    void release() {
+        head.store((head.load(std::memory_order_relaxed) + 1) % slots.size(), std::memory_order_release);
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    // Back-pressure statistics, written by the producer only
+    size_t pushed = 0;
+    size_t full_events = 0;
+    size_t max_occupancy = 0;
+    long long blocked_ns = 0;
+
+private:
+    std::vector<std::vector<unsigned>> slots;
+    unsigned width;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+};
+
+// Calibration stage fed line by line: background normalization runs as each line arrives,
+// the frame-wide calibration runs once the last line of the frame is in.
+std::vector<std::vector<PixelData>> calibrate_lines(LineRing& ring, unsigned height) {
+    std::vector<std::vector<PixelData>> processed_data(height, std::vector<PixelData>(ring.line_width()));
+    unsigned received = 0;
+    const unsigned* line;
+    while (received < height && (line = ring.front()) != nullptr) {
+        normalize_background(line, processed_data[received++]);
+        ring.release();
+    }
+    if (received < height) {
+        throw std::runtime_error("Error: line stream ended after " + std::to_string(received) + " of " + std::to_string(height) + " lines.");
+    }
+    std::vector<double> median_betathrone, median_detector;
+    calibrate_processed_data(processed_data, median_betathrone, median_detector);
+    return processed_data;
+}
+
+const size_t LINE_RING_CAPACITY = 64;
+
+// Test harness: replays the lines of a scan into the ring at a fixed rate (0 = as fast as possible)
+// and checks that the streamed calibration matches process_data on the whole file.
+int run_ring_test(const std::string& filename, double lines_per_second, size_t capacity) {
+    unsigned m, n;
+    auto data = read_data_from_file(filename, m, n);
+    auto expected = process_data(data);
+
+    LineRing ring(capacity, n);
+    std::thread producer([&]() {
+        auto period = std::chrono::duration<double>(lines_per_second > 0 ? 1.0 / lines_per_second : 0.0);
+        auto next_tick = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < m; ++i) {
+            if (lines_per_second > 0) {
+                std::this_thread::sleep_until(next_tick);
+                next_tick += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+            }
+            unsigned* slot = ring.acquire();
+            std::copy(data[i].begin(), data[i].end(), slot);
+            ring.publish();
+        }
+        ring.close();
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<PixelData>> actual;
+    try {
+        actual = calibrate_lines(ring, m);
+    } catch (...) {
+        producer.join();
+        throw;
+    }
+    producer.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool identical = true;
+    for (unsigned i = 0; i < m && identical; ++i) {
+        for (unsigned j = 0; j < n; ++j) {
+            if (actual[i][j].value != expected[i][j].value || actual[i][j].is_calibrated != expected[i][j].is_calibrated) {
+                identical = false;
+                break;
+            }
+        }
+    }
+
+    std::cout << "lines pushed: " << ring.pushed << ", capacity: " << capacity
+              << ", max occupancy: " << ring.max_occupancy
+              << ", producer stalls: " << ring.full_events
+              << " (" << std::fixed << std::setprecision(3) << ring.blocked_ns / 1e6 << " ms blocked)" << std::endl;
+    std::cout << "achieved rate: " << std::setprecision(0) << m / seconds << " lines/s" << std::endl;
+    std::cout << (identical ? "OK: streamed calibration matches batch calibration" : "FAIL: streamed calibration differs") << std::endl;
+    return identical ? 0 : 1;
+}
+
+// Helpers for blocking socket I/O of whole buffers
+void write_all(int fd, const void* buffer, size_t size) {
+    const char* p = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t written = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (written <= 0) {
+            throw std::runtime_error("Error: socket write failed: " + std::string(std::strerror(errno)));
+        }
+        p += written;
+        size -= written;
+    }
+}
+
+bool read_all(int fd, void* buffer, size_t size) {
+    char* p = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t got = ::read(fd, p, size);
+        if (got == 0) {
+            return false;
+        }
+        if (got < 0) {
+            throw std::runtime_error("Error: socket read failed: " + std::string(std::strerror(errno)));
+        }
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Error: socket path too long: " + path);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+// Monotonic clock shared by all processes on the host, used to timestamp lines on the wire
+long long monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Scanner simulator: serves one block.int over a UNIX socket as the 16-word header
+// followed by one packet per line (8-byte send timestamp + width raw samples) at a fixed pulse rate.
+int run_simulator(const std::string& filename, const std::string& socket_path, double pulse_rate) {
+    std::ifstream inf(filename, std::fstream::in | std::fstream::binary);
+    if (!inf.is_open()) {
+        throw std::runtime_error("Error: could not open file " + filename);
+    }
+    unsigned header[16];
+    inf.read(reinterpret_cast<char*>(header), sizeof(header));
+    unsigned width = header[0], height = header[1];
+    if (!inf || height == 0 || width == 0) {
+        throw std::runtime_error("Error: image dimensions cannot be zero.");
+    }
+    std::vector<unsigned> lines(static_cast<size_t>(height) * width);
+    inf.read(reinterpret_cast<char*>(lines.data()), lines.size() * sizeof(unsigned));
+    if (!inf) {
+        throw std::runtime_error("Error: unexpected end of file " + filename);
+    }
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_address(socket_path);
+    ::unlink(socket_path.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 1) != 0) {
+        throw std::runtime_error("Error: could not listen on " + socket_path + ": " + std::strerror(errno));
+    }
+    std::cout << "Serving " << filename << " (" << width << "x" << height << ") on " << socket_path
+              << " at " << pulse_rate << " lines/s" << std::endl;
+    int client = ::accept(listener, nullptr, nullptr);
+    ::close(listener);
+    ::unlink(socket_path.c_str());
+    if (client < 0) {
+        throw std::runtime_error("Error: accept failed: " + std::string(std::strerror(errno)));
+    }
+
+    write_all(client, header, sizeof(header));
+    std::vector<char> packet(sizeof(long long) + width * sizeof(unsigned));
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(pulse_rate > 0 ? 1.0 / pulse_rate : 0.0));
+    auto next_tick = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < height; ++i) {
+        if (pulse_rate > 0) {
+            std::this_thread::sleep_until(next_tick);
+            next_tick += period;
+        }
+        std::memcpy(packet.data() + sizeof(long long), &lines[static_cast<size_t>(i) * width], width * sizeof(unsigned));
+        long long sent = monotonic_ns();
+        std::memcpy(packet.data(), &sent, sizeof(sent));
+        write_all(client, packet.data(), packet.size());
+    }
+    ::close(client);
+    std::cout << "Sent " << height << " lines." << std::endl;
+    return 0;
+}
+
+double percentile(std::vector<long long> samples, double fraction) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    size_t index = static_cast<size_t>(fraction * (samples.size() - 1) + 0.5);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return static_cast<double>(samples[index]);
+}
+
+// Receive mode: consumes a simulator (or scanner) line feed through the line ring, calibrates it
+// and reports the per-line latency from send to background normalization.
+int run_receiver(const std::string& socket_path, const std::string& output) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_address(socket_path);
+    bool connected = false;
+    for (int attempt = 0; attempt < 50 && !connected; ++attempt) {
+        connected = ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        if (!connected) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (!connected) {
+        ::close(fd);
+        throw std::runtime_error("Error: could not connect to " + socket_path + ": " + std::strerror(errno));
+    }
+
+    unsigned header[16];
+    if (!read_all(fd, header, sizeof(header)) || header[0] == 0 || header[1] == 0) {
+        ::close(fd);
+        throw std::runtime_error("Error: invalid line feed header.");
+    }
+    unsigned width = header[0], height = header[1];
+
+    LineRing ring(LINE_RING_CAPACITY, width);
+    std::vector<long long> sent_ns(height), latency_ns(height);
+    std::string receive_error;
+    std::thread receiver([&]() {
+        try {
+            for (unsigned i = 0; i < height; ++i) {
+                unsigned* slot = ring.acquire();
+                if (!read_all(fd, &sent_ns[i], sizeof(long long)) || !read_all(fd, slot, width * sizeof(unsigned))) {
+                    receive_error = "Error: line feed closed after " + std::to_string(i) + " lines.";
+                    break;
+                }
+                ring.publish();
+            }
+        } catch (const std::exception& e) {
+            receive_error = e.what();
+        }
+        ring.close();
+    });
+
+    std::vector<std::vector<PixelData>> processed_data(height, std::vector<PixelData>(width));
+    unsigned received = 0;
+    const unsigned* line;
+    while (received < height && (line = ring.front()) != nullptr) {
+        normalize_background(line, processed_data[received]);
+        latency_ns[received] = monotonic_ns() - sent_ns[received];
+        ++received;
+        ring.release();
+    }
+    receiver.join();
+    ::close(fd);
+    if (received < height) {
+        throw std::runtime_error(receive_error.empty() ? "Error: line feed incomplete." : receive_error);
+    }
+    std::vector<double> median_betathrone, median_detector;
+    calibrate_processed_data(processed_data, median_betathrone, median_detector);
+    create_and_save_image(processed_data, output);
+
+    std::cout << "Received " << received << " lines (" << width << " samples each), ring stalls: " << ring.full_events << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+              << "latency us: p50 " << percentile(latency_ns, 0.50) / 1e3
+              << ", p99 " << percentile(latency_ns, 0.99) / 1e3
+              << ", p999 " << percentile(latency_ns, 0.999) / 1e3
+              << ", max " << *std::max_element(latency_ns.begin(), latency_ns.end()) / 1e3 << std::endl;
+    std::cout << "Image '" << output << "' generated successfully." << std::endl;
+    return 0;
+}
+
+// Warm per-worker state: frame buffers stay allocated between requests of the same size
+struct ServiceWorker {
+    FrameBuffers frame;
+    std::vector<char> payload;
+};
+
+const unsigned DEFAULT_SERVICE_WORKERS = 4;
+const size_t MAX_RAW_REQUEST_BYTES = 1u << 30;
+
+// Handles one request line and returns the reply line.
+//   SCAN <path> [thickness]                 process a block.int on disk
+//   RAW <output prefix> <bytes> [thickness] process <bytes> of block.int content sent after the line
+std::string handle_service_request(ServiceWorker& worker, int fd, const std::string& request) {
+    std::istringstream words(request);
+    std::string command, target, option;
+    words >> command >> target;
+    auto start = std::chrono::steady_clock::now();
+
+    std::string prefix;
+    if (command == "SCAN" && !target.empty()) {
+        words >> option;
+        read_frame(target, worker.frame);
+        prefix = target;
+    } else if (command == "RAW" && !target.empty()) {
+        size_t size = 0;
+        words >> size >> option;
+        if (size == 0 || size > MAX_RAW_REQUEST_BYTES) {
+            throw std::runtime_error("Error: invalid RAW payload size.");
+        }
+        worker.payload.resize(size);
+        if (!read_all(fd, worker.payload.data(), size)) {
+            throw std::runtime_error("Error: connection closed inside RAW payload.");
+        }
+        parse_frame(reinterpret_cast<const unsigned char*>(worker.payload.data()), size, worker.frame);
+        prefix = target + ".int";
+    } else {
+        throw std::runtime_error("Error: unknown request '" + request + "'.");
+    }
+    double read_ms = elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    process_frame(worker.frame);
+    double calibrate_ms = elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    std::string reply = "OK " + output_path(prefix, "normalized");
+    create_and_save_image(worker.frame.processed_data, output_path(prefix, "normalized"), worker.frame.strip);
+    if (option == "thickness") {
+        calculate_and_save_thickness(worker.frame.processed_data, output_path(prefix, "thickness"), worker.frame.strip);
+        reply += " " + output_path(prefix, "thickness");
+    }
+    double write_ms = elapsed_ms(start);
+
+    std::ostringstream timings;
+    timings << std::fixed << std::setprecision(3) << " read_ms=" << read_ms << " calibrate_ms=" << calibrate_ms << " write_ms=" << write_ms;
+    return reply + timings.str();
+}
+
+const size_t MAX_REQUEST_LINE = 64u << 10;
+const int SERVICE_IDLE_SECONDS = 60;
+
+// Reads one newline-terminated line. Returns false at end of stream, on a read error or timeout,
+// and for a line longer than MAX_REQUEST_LINE, so the caller drops the connection.
+bool read_request_line(int fd, std::string& line) {
+    line.clear();
+    char c;
+    while (true) {
+        ssize_t got = ::read(fd, &c, 1);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return got == 0 && !line.empty();
+        }
+        if (c == '\n') {
+            return true;
+        }
+        if (line.size() == MAX_REQUEST_LINE) {
+            return false;
+        }
+        line += c;
+    }
+}
+
+// Long-running processing service on a UNIX socket with a warm worker pool.
+// Each connection is served by one worker; connections are processed concurrently. A client that
+// stays silent for SERVICE_IDLE_SECONDS is disconnected so it cannot hold a worker indefinitely.
+int run_service(const std::string& socket_path, unsigned worker_count) {
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_address(socket_path);
+    ::unlink(socket_path.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 64) != 0) {
+        throw std::runtime_error("Error: could not listen on " + socket_path + ": " + std::strerror(errno));
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<int> connections;
+    std::atomic<bool> stopping{false};
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&]() {
+            ServiceWorker worker;
+            while (true) {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&]() { return stopping || !connections.empty(); });
+                    if (connections.empty()) {
+                        return;
+                    }
+                    fd = connections.front();
+                    connections.pop_front();
+                }
+                std::string request;
+                while (read_request_line(fd, request)) {
+                    if (request == "SHUTDOWN") {
+                        stopping = true;
+                        ::shutdown(listener, SHUT_RDWR);
+                        break;
+                    }
+                    std::string reply;
+                    try {
+                        reply = handle_service_request(worker, fd, request);
+                    } catch (const std::exception& e) {
+                        reply = std::string("ERROR ") + e.what();
+                    }
+                    try {
+                        write_all(fd, (reply + "\n").data(), reply.size() + 1);
+                    } catch (const std::exception&) {
+                        break;
+                    }
+                }
+                ::close(fd);
+            }
+        });
+    }
+
+    std::cout << "Listening on " << socket_path << " with " << worker_count << " workers" << std::endl;
+    while (!stopping) {
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            break;
+        }
+        timeval idle{SERVICE_IDLE_SECONDS, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.push_back(fd);
+        ready.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    ::close(listener);
+    ::unlink(socket_path.c_str());
+    return 0;
+}
+
+// Minimal client for the service: one SCAN request per file, replies printed as received
+int run_submit(const std::string& socket_path, const std::vector<std::string>& requests) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_address(socket_path);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Error: could not connect to " + socket_path + ": " + std::strerror(errno));
+    }
+    int failures = 0;
+    for (const auto& request : requests) {
+        std::string line = (request == "SHUTDOWN" ? request : "SCAN " + request + " thickness") + "\n";
+        write_all(fd, line.data(), line.size());
+        if (request == "SHUTDOWN") {
+            break;
+        }
+        std::string reply;
+        if (!read_request_line(fd, reply)) {
+            ++failures;
+            break;
+        }
+        std::cout << reply << std::endl;
+        failures += reply.compare(0, 3, "OK ") != 0;
+    }
+    ::close(fd);
+    return failures == 0 ? 0 : 1;
+}
+
+// Calibrates the pixels (row + r * stride, column + c * stride) of a mapped scan for r < height and
+// c < width. Only those rows are touched, and of them only the sampled columns and the detector
+// reference columns; the beta-pulse intensities come from the reference rows alone. The time is
+// proportional to the sampled pixels plus the reference bands, and every calibrated pixel equals
+// the same pixel of a full scan.
+std::vector<std::vector<PixelData>> calibrate_region(const ScanFile& scan, unsigned column, unsigned row,
+                                                     unsigned width, unsigned height, unsigned stride) {
+    unsigned m = scan.header().height();
+    unsigned n = scan.header().width();
+    if (width == 0 || height == 0 || stride == 0 || column >= n || row >= m ||
+        (width - 1) >= (n - column + stride - 1) / stride || (height - 1) >= (m - row + stride - 1) / stride) {
+        throw std::runtime_error("Error: region is empty or outside the " + std::to_string(n) + "x" + std::to_string(m) + " scan.");
+    }
+    if (m < BETA_THORNE_ROWS_COUNT || n < MEDIAN_DETECTOR_COUNT) {
+        throw std::runtime_error("Error: scan is too small for calibration.");
+    }
+    ReferenceRegions regions;
+    if (reference_auto) {
+        std::lock_guard<std::mutex> lock(reference_cache_mutex);
+        CachedRegions* cached = find_cached_regions(scan.header().label(), m, n);
+        if (!cached) {
+            throw std::runtime_error("Error: no reference regions cached for this scanner; process a full scan with --reference auto first.");
+        }
+        regions = cached->regions;
+    }
+    unsigned beta_first = regions.beta_first_row >= 0 ? regions.beta_first_row : m - BETA_THORNE_ROWS_COUNT;
+    unsigned detector_first = regions.detector_first_column >= 0 ? regions.detector_first_column : n - MEDIAN_DETECTOR_COUNT;
+
+    // Per-pulse intensity of every column, measured on the reference rows only
+    std::vector<std::vector<PixelData>> reference;
+    ReferenceRegions reference_regions;
+    DoseMonitor monitor = dose_monitor;
+    std::vector<unsigned> reference_rows;
+    if (monitor.source == DoseSource::BetaThorne) {
+        for (unsigned i = beta_first; i < beta_first + BETA_THORNE_ROWS_COUNT; ++i) {
+            reference_rows.push_back(i);
+        }
+        reference_regions.beta_first_row = 0;
+    } else if (monitor.source == DoseSource::ReferenceRow) {
+        if (monitor.index >= m) {
+            throw std::runtime_error("Error: reference detector row " + std::to_string(monitor.index) + " is outside the scan.");
+        }
+        reference_rows.push_back(monitor.index);
+        monitor.index = 0;
+    }
+    reference.assign(std::max<size_t>(reference_rows.size(), 1), std::vector<PixelData>(n, PixelData{0.0, false}));
+    for (size_t k = 0; k < reference_rows.size(); ++k) {
+        normalize_background(scan.row(reference_rows[k]), reference[k]);
+    }
+    std::vector<double> intensity;
+    measure_beta_pulses(reference, intensity, scan.pulses(), reference_regions, monitor);
+    double overall_median = std::accumulate(intensity.begin(), intensity.end(), 0.0) / n;
+
+    // ROI rows: the ROI columns followed by the detector reference columns
+    unsigned columns = width + MEDIAN_DETECTOR_COUNT;
+    std::vector<unsigned> source_column(columns);
+    std::vector<double> roi_intensity(columns);
+    for (unsigned c = 0; c < columns; ++c) {
+        source_column[c] = c < width ? column + c * stride : detector_first + (c - width);
+        roi_intensity[c] = intensity[source_column[c]];
+    }
+    std::vector<std::vector<PixelData>> roi(height, std::vector<PixelData>(columns));
+    scheduler().parallel_for("region normalize", height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        std::vector<unsigned> samples(columns);
+        for (size_t r = begin; r < end; ++r) {
+            unsigned i = row + r * stride;
+            const unsigned* line = scan.row(i);
+            for (unsigned c = 0; c < columns; ++c) {
+                samples[c] = line[source_column[c]];
+            }
+            normalize_background(samples.data(), roi[r]);
+            // Pixels the beta-pulse intensities were measured on stay uncorrected, as in a full scan
+            bool reference_row = std::find(reference_rows.begin(), reference_rows.end(), i) != reference_rows.end();
+            for (auto& pixel : roi[r]) {
+                pixel.is_calibrated = reference_row;
+            }
+        }
+    });
+    apply_beta_correction(roi, roi_intensity, overall_median);
+    ReferenceRegions roi_regions;
+    roi_regions.detector_first_column = width;
+    std::vector<double> median_detector;
+    correct_detectors(roi, median_detector, roi_regions);
+    // ROI columns inside the detector band are reference pixels; take them from the band copy
+    for (auto& pixels : roi) {
+        for (unsigned c = 0; c < width; ++c) {
+            if (source_column[c] >= detector_first && source_column[c] < detector_first + MEDIAN_DETECTOR_COUNT) {
+                pixels[c] = pixels[width + source_column[c] - detector_first];
+            }
+        }
+        pixels.resize(width);
+    }
+    return roi;
+}
+
+// Region-of-interest processing: time proportional to the ROI rather than to the scan
+int run_roi(const std::string& filename, unsigned column, unsigned row, unsigned width, unsigned height, bool with_thickness) {
+    auto start = std::chrono::steady_clock::now();
+    ScanFile scan(filename);
+    std::vector<std::vector<PixelData>> roi = calibrate_region(scan, column, row, width, height, 1);
+
+    create_and_save_image(roi, image_name("roi_normalized"));
+    std::cout << "ROI " << width << "x" << height << " at column " << column << ", row " << row
+              << " written to '" << image_name("roi_normalized") << "'";
+    if (with_thickness) {
+        calculate_and_save_thickness(roi, image_name("roi_thickness"));
+        std::cout << " and '" << image_name("roi_thickness") << "'";
+    }
+    std::cout << " in " << std::fixed << std::setprecision(3) << elapsed_ms(start) << " ms." << std::endl;
+    return 0;
+}
+
+const unsigned DEFAULT_PREVIEW_FACTOR = 8;
+
+// Progressive output: a preview of every factor-th row and column, calibrated from the strided
+// samples and the reference bands only, is written first; the full-resolution image follows.
+int run_progressive(const std::string& filename, unsigned factor, bool with_thickness) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        ScanFile scan(filename);
+        unsigned m = scan.header().height();
+        unsigned n = scan.header().width();
+        std::vector<std::vector<PixelData>> preview =
+            calibrate_region(scan, 0, 0, (n + factor - 1) / factor, (m + factor - 1) / factor, factor);
+        create_and_save_image(preview, image_name("preview_image"));
+        std::cout << "Preview '" << image_name("preview_image") << "' (" << preview[0].size() << "x" << preview.size() << ", 1/" << factor
+                  << ") generated in " << std::fixed << std::setprecision(3) << elapsed_ms(start) << " ms." << std::endl;
+    }
+
+    FrameBuffers frame;
+    read_frame(filename, frame);
+    save_output(frame, "normalized", image_name("normalized_image"), create_and_save_image);
+    std::cout << "Image '" << image_name("normalized_image") << "' generated in " << elapsed_ms(start) << " ms." << std::endl;
+    if (with_thickness) {
+        save_output(frame, "thickness", image_name("thickness_image"), calculate_and_save_thickness);
+        std::cout << "Image '" << image_name("thickness_image") << "' generated in " << elapsed_ms(start) << " ms." << std::endl;
+    }
+    return 0;
+}
+
+// Per-pixel feature vectors for clustering, feature-major: one float array per feature so that
+// a distance pass streams through contiguous memory. Features are standardized to zero mean and
+// unit variance; mean and scale map a standardized value back to the feature's own units.
+struct FeatureSet {
+    unsigned height = 0;
+    unsigned width = 0;
+    std::vector<std::string> names;
+    std::vector<std::vector<float>> columns;
+    std::vector<double> mean;
+    std::vector<double> scale;
+    std::vector<double> low;   // range of each feature in its own units
+    std::vector<double> high;
+
+    size_t count() const { return static_cast<size_t>(height) * width; }
+    unsigned dimensions() const { return names.size(); }
+};
+
+const size_t FEATURE_CHUNK = 16384;
+
+// Standardizes a feature column in place, recording its mean, scale and range
+void standardize_feature(FeatureSet& features, unsigned feature) {
+    std::vector<float>& values = features.columns[feature];
+    size_t count = values.size();
+    size_t chunks = (count + FEATURE_CHUNK - 1) / FEATURE_CHUNK;
+    std::vector<double> sums(chunks), squares(chunks);
+    std::vector<float> lows(chunks, std::numeric_limits<float>::infinity()), highs(chunks, -std::numeric_limits<float>::infinity());
+    scheduler().parallel_for("feature statistics", chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            for (size_t k = c * FEATURE_CHUNK; k < std::min(count, (c + 1) * FEATURE_CHUNK); ++k) {
+                sums[c] += values[k];
+                squares[c] += static_cast<double>(values[k]) * values[k];
+                lows[c] = std::min(lows[c], values[k]);
+                highs[c] = std::max(highs[c], values[k]);
+            }
+        }
+    });
+    double mean = std::accumulate(sums.begin(), sums.end(), 0.0) / count;
+    double variance = std::accumulate(squares.begin(), squares.end(), 0.0) / count - mean * mean;
+    double scale = variance > 0 ? std::sqrt(variance) : 1.0;
+    scheduler().parallel_for("feature standardize", chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t k = begin * FEATURE_CHUNK; k < std::min(count, end * FEATURE_CHUNK); ++k) {
+            values[k] = static_cast<float>((values[k] - mean) / scale);
+        }
+    });
+    features.mean.push_back(mean);
+    features.scale.push_back(scale);
+    features.low.push_back(*std::min_element(lows.begin(), lows.end()));
+    features.high.push_back(*std::max_element(highs.begin(), highs.end()));
+}
+
+// Clustering features of one calibrated value, as build_features computes the value and thickness
+const unsigned INTENSITY_FEATURES = 2;
+
+inline void intensity_features(double value, float* out) {
+    out[0] = static_cast<float>(value);
+    out[1] = static_cast<float>(thickness_of(value));
+}
+
+// Per-pixel features that extract_features can compute. The local mean and variance are taken over
+// a (2r+1)x(2r+1) window and the gradient magnitude with the Sobel kernel; both replicate the
+// frame edges. Row and column are the pixel position, so clusters can be kept spatially compact.
+enum class PixelFeature { Value, Thickness, LocalMean, LocalVariance, Gradient, Row, Column };
+
+const std::vector<std::pair<std::string, PixelFeature>> PIXEL_FEATURES = {
+    {"value", PixelFeature::Value}, {"thickness", PixelFeature::Thickness}, {"mean", PixelFeature::LocalMean},
+    {"variance", PixelFeature::LocalVariance}, {"gradient", PixelFeature::Gradient}, {"row", PixelFeature::Row},
+    {"column", PixelFeature::Column}};
+const std::string DEFAULT_FEATURES = "value,thickness";
+const int LOCAL_WINDOW_RADIUS = 2;
+const unsigned FEATURE_TILE_ROWS = 32;
+
+PixelFeature pixel_feature(const std::string& name) {
+    for (const auto& feature : PIXEL_FEATURES) {
+        if (feature.first == name) {
+            return feature.second;
+        }
+    }
+    std::string available;
+    for (const auto& feature : PIXEL_FEATURES) {
+        available += (available.empty() ? "" : ", ") + feature.first;
+    }
+    throw std::runtime_error("Error: unknown feature '" + name + "'; available features are " + available + ".");
+}
+
+std::vector<std::string> split_feature_names(const std::string& list) {
+    std::vector<std::string> names;
+    std::istringstream fields(list);
+    std::string name;
+    while (std::getline(fields, name, ',')) {
+        pixel_feature(name);
+        names.push_back(name);
+    }
+    if (names.empty()) {
+        throw std::runtime_error("Error: no features given.");
+    }
+    return names;
+}
+
+// Computes the named features of every pixel, in their own units, in one parallel pass over bands
+// of rows. The window sums are separable: each band keeps the vertical sum of every column over
+// the window rows, sliding it down one row at a time, and slides a horizontal sum along each row.
+FeatureSet extract_features(const std::vector<std::vector<PixelData>>& data, const std::vector<std::string>& names) {
+    FeatureSet features;
+    features.height = data.size();
+    features.width = data[0].size();
+    features.names = names;
+    std::vector<PixelFeature> kinds;
+    bool windowed = false;
+    for (const auto& name : names) {
+        kinds.push_back(pixel_feature(name));
+        windowed = windowed || kinds.back() == PixelFeature::LocalMean || kinds.back() == PixelFeature::LocalVariance;
+        features.columns.emplace_back(features.count());
+    }
+    const long height = features.height, width = features.width, radius = LOCAL_WINDOW_RADIUS;
+    const double window = static_cast<double>(2 * radius + 1) * (2 * radius + 1);
+    auto clamp_row = [&](long i) { return std::min(std::max(i, 0L), height - 1); };
+    auto clamp_column = [&](long j) { return std::min(std::max(j, 0L), width - 1); };
+    size_t bands = (features.height + FEATURE_TILE_ROWS - 1) / FEATURE_TILE_ROWS;
+    scheduler().parallel_for("features", bands, 1, [&](size_t begin, size_t end) {
+        std::vector<double> sums(width), squares(width);
+        auto add_row = [&](long i, double sign) {
+            const auto& row = data[clamp_row(i)];
+            for (long j = 0; j < width; ++j) {
+                sums[j] += sign * row[j].value;
+                squares[j] += sign * row[j].value * row[j].value;
+            }
+        };
+        for (size_t band = begin; band < end; ++band) {
+            long first = band * FEATURE_TILE_ROWS, last = std::min<long>(height, first + FEATURE_TILE_ROWS);
+            if (windowed) {
+                std::fill(sums.begin(), sums.end(), 0.0);
+                std::fill(squares.begin(), squares.end(), 0.0);
+                for (long i = first - radius; i <= first + radius; ++i) {
+                    add_row(i, 1.0);
+                }
+            }
+            for (long i = first; i < last; ++i) {
+                if (windowed && i > first) {
+                    add_row(i + radius, 1.0);
+                    add_row(i - radius - 1, -1.0);
+                }
+                const auto& above = data[clamp_row(i - 1)];
+                const auto& row = data[i];
+                const auto& below = data[clamp_row(i + 1)];
+                double box = 0.0, box_squares = 0.0;
+                if (windowed) {
+                    for (long j = -radius; j <= radius; ++j) {
+                        box += sums[clamp_column(j)];
+                        box_squares += squares[clamp_column(j)];
+                    }
+                }
+                for (long j = 0; j < width; ++j) {
+                    if (windowed && j > 0) {
+                        box += sums[clamp_column(j + radius)] - sums[clamp_column(j - radius - 1)];
+                        box_squares += squares[clamp_column(j + radius)] - squares[clamp_column(j - radius - 1)];
+                    }
+                    size_t pixel = i * width + j;
+                    for (size_t f = 0; f < kinds.size(); ++f) {
+                        double feature = 0.0;
+                        switch (kinds[f]) {
+                        case PixelFeature::Value:
+                            feature = row[j].value;
+                            break;
+                        case PixelFeature::Thickness:
+                            feature = thickness_of(row[j].value);
+                            break;
+                        case PixelFeature::LocalMean:
+                            feature = box / window;
+                            break;
+                        case PixelFeature::LocalVariance:
+                            feature = std::max(0.0, box_squares / window - (box / window) * (box / window));
+                            break;
+                        case PixelFeature::Gradient: {
+                            long left = clamp_column(j - 1), right = clamp_column(j + 1);
+                            double gx = (above[right].value + 2 * row[right].value + below[right].value)
+                                      - (above[left].value + 2 * row[left].value + below[left].value);
+                            double gy = (below[left].value + 2 * below[j].value + below[right].value)
+                                      - (above[left].value + 2 * above[j].value + above[right].value);
+                            feature = std::sqrt(gx * gx + gy * gy);
+                            break;
+                        }
+                        case PixelFeature::Row:
+                            feature = i;
+                            break;
+                        case PixelFeature::Column:
+                            feature = j;
+                            break;
+                        }
+                        features.columns[f][pixel] = static_cast<float>(feature);
+                    }
+                }
+            }
+        }
+    });
+    return features;
+}
+
+// The named features of every pixel, standardized for clustering
+FeatureSet build_features(const std::vector<std::vector<PixelData>>& data, const std::vector<std::string>& names) {
+    FeatureSet features = extract_features(data, names);
+    for (unsigned f = 0; f < features.dimensions(); ++f) {
+        standardize_feature(features, f);
+    }
+    return features;
+}
+
+// Exact k-means (the result of Lloyd's algorithm from the same seeds) with most point-center
+// distances skipped through triangle-inequality bounds. Hamerly keeps one upper and one lower
+// bound per point, which suits small k; Elkan keeps a lower bound per point and center, which
+// prunes better when k and the dimensionality are both large. Bounds are floats; points are processed in parallel chunks.
+enum class KMeansMethod { Auto, Lloyd, Hamerly, Elkan };
+
+const unsigned ELKAN_MIN_CLUSTERS = 16;
+const unsigned ELKAN_MIN_DIMENSIONS = 8;
+const size_t KMEANS_SEED_SAMPLE = 20000;
+
+// Squared distance between two row-major feature vectors
+inline double squared_distance(const float* a, const float* b, unsigned dimensions) {
+    double sum = 0.0;
+    for (unsigned f = 0; f < dimensions; ++f) {
+        double delta = a[f] - b[f];
+        sum += delta * delta;
+    }
+    return sum;
+}
+
+// Index of the center (k x dimensions) nearest to a point; squared receives its squared distance
+unsigned nearest_center(const float* point, const std::vector<float>& centers, unsigned dimensions, double* squared = nullptr) {
+    unsigned best = 0;
+    double best_distance = std::numeric_limits<double>::infinity();
+    for (unsigned c = 0; c * dimensions < centers.size(); ++c) {
+        double distance = squared_distance(point, &centers[c * dimensions], dimensions);
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = c;
+        }
+    }
+    if (squared) {
+        *squared = best_distance;
+    }
+    return best;
+}
+
+// k-means++ seeding over row-major sample points: the first point, then each next center drawn
+// with probability proportional to the squared distance from the nearest center chosen so far
+std::vector<float> kmeans_plus_plus(const std::vector<float>& sample, unsigned dimensions, unsigned k, std::mt19937& random) {
+    size_t count = sample.size() / dimensions;
+    std::vector<float> centers(static_cast<size_t>(k) * dimensions);
+    std::vector<double> nearest(count, std::numeric_limits<double>::infinity());
+    size_t chosen = 0;
+    for (unsigned c = 0; c < k; ++c) {
+        std::copy_n(&sample[chosen * dimensions], dimensions, &centers[c * dimensions]);
+        double total = 0.0;
+        for (size_t s = 0; s < count; ++s) {
+            nearest[s] = std::min(nearest[s], squared_distance(&sample[s * dimensions], &centers[c * dimensions], dimensions));
+            total += nearest[s];
+        }
+        double target = std::uniform_real_distribution<double>(0.0, total)(random);
+        size_t s = 0;
+        while (s + 1 < count && (target -= nearest[s]) > 0) {
+            ++s;
+        }
+        chosen = s;
+    }
+    return centers;
+}
+
+struct KMeansResult {
+    unsigned k = 0;
+    unsigned dimensions = 0;
+    std::vector<float> centers;    // k x dimensions
+    std::vector<uint16_t> labels;  // per pixel
+    unsigned iterations = 0;
+    bool converged = false;
+    uint64_t distance_computations = 0;
+    double inertia = 0.0;          // mean squared distance of the pixels to their centers
+};
+
+class KMeans {
+public:
+    KMeans(const FeatureSet& features, unsigned k, KMeansMethod method, unsigned max_iterations)
+        : features(features), k(k), d(features.dimensions()), count(features.count()),
+          method(method == KMeansMethod::Auto ? (k >= ELKAN_MIN_CLUSTERS && d >= ELKAN_MIN_DIMENSIONS ? KMeansMethod::Elkan : KMeansMethod::Hamerly) : method),
+          max_iterations(max_iterations), chunks((count + FEATURE_CHUNK - 1) / FEATURE_CHUNK), chunk_distances(chunks) {
+        if (k == 0 || k > count || k > UINT16_MAX) {
+            throw std::runtime_error("Error: k must be between 1 and the number of pixels.");
+        }
+    }
+
+    KMeansMethod chosen_method() const { return method; }
+
+    // Seeds the centers with k-means++ on a fixed random sample of pixels
+    void seed(uint32_t random_seed) {
+        std::mt19937 random(random_seed);
+        std::uniform_int_distribution<size_t> any_point(0, count - 1);
+        std::vector<float> sample(std::min(count, KMEANS_SEED_SAMPLE) * d);
+        for (size_t s = 0; s < sample.size(); s += d) {
+            size_t point = any_point(random);
+            for (unsigned f = 0; f < d; ++f) {
+                sample[s + f] = features.columns[f][point];
+            }
+        }
+        result.k = k;
+        result.dimensions = d;
+        result.centers = kmeans_plus_plus(sample, d, k, random);
+    }
+
+    KMeansResult run() {
+        result.labels.assign(count, 0);
+        upper.assign(count, 0.0f);
+        lower.assign(count * (method == KMeansMethod::Elkan ? k : 1), 0.0f);
+        std::vector<float> moves(k, 0.0f);
+        size_t changed = assign_all();
+        for (result.iterations = 1; ; ++result.iterations) {
+            update_centers(moves);
+            if (changed == 0 || result.iterations >= max_iterations) {
+                break;
+            }
+            changed = method == KMeansMethod::Lloyd ? assign_all() : method == KMeansMethod::Hamerly ? hamerly_pass(moves) : elkan_pass(moves);
+        }
+        result.converged = changed == 0;
+        std::vector<double> chunk_inertia(chunks, 0.0);
+        scheduler().parallel_for("k-means inertia", chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c) {
+                for (size_t point = c * FEATURE_CHUNK; point < std::min(count, (c + 1) * FEATURE_CHUNK); ++point) {
+                    chunk_inertia[c] += squared_distance(point, result.labels[point]);
+                }
+            }
+        });
+        result.inertia = std::accumulate(chunk_inertia.begin(), chunk_inertia.end(), 0.0) / count;
+        result.distance_computations = std::accumulate(chunk_distances.begin(), chunk_distances.end(), uint64_t(0));
+        return std::move(result);
+    }
+
+private:
+    double squared_distance(size_t point, unsigned center) const {
+        double sum = 0.0;
+        for (unsigned f = 0; f < d; ++f) {
+            double delta = features.columns[f][point] - result.centers[center * d + f];
+            sum += delta * delta;
+        }
+        return sum;
+    }
+
+    float distance(size_t point, unsigned center) const {
+        return static_cast<float>(std::sqrt(squared_distance(point, center)));
+    }
+
+    float center_distance(unsigned a, unsigned b) const {
+        double sum = 0.0;
+        for (unsigned f = 0; f < d; ++f) {
+            double delta = result.centers[a * d + f] - result.centers[b * d + f];
+            sum += delta * delta;
+        }
+        return static_cast<float>(std::sqrt(sum));
+    }
+
+    // Runs body(point, distances) over every point in parallel chunks; returns the changed labels
+    template <typename Body>
+    size_t for_each_point(const char* label, Body body) {
+        std::vector<size_t> changed(chunks, 0);
+        scheduler().parallel_for(label, chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c) {
+                uint64_t distances = 0;
+                for (size_t point = c * FEATURE_CHUNK; point < std::min(count, (c + 1) * FEATURE_CHUNK); ++point) {
+                    changed[c] += body(point, distances);
+                }
+                chunk_distances[c] += distances;
+            }
+        });
+        return std::accumulate(changed.begin(), changed.end(), size_t(0));
+    }
+
+    // Assigns every point by computing all k distances; also sets exact bounds
+    size_t assign_all() {
+        return for_each_point("k-means assign", [&](size_t point, uint64_t& distances) {
+            float best = std::numeric_limits<float>::infinity(), second = best;
+            unsigned best_center = 0;
+            for (unsigned c = 0; c < k; ++c) {
+                float distance_to_c = distance(point, c);
+                if (method == KMeansMethod::Elkan) {
+                    lower[point * k + c] = distance_to_c;
+                }
+                if (distance_to_c < best) {
+                    second = best;
+                    best = distance_to_c;
+                    best_center = c;
+                } else if (distance_to_c < second) {
+                    second = distance_to_c;
+                }
+            }
+            distances += k;
+            upper[point] = best;
+            if (method == KMeansMethod::Hamerly) {
+                lower[point] = second;
+            }
+            bool moved = result.labels[point] != best_center;
+            result.labels[point] = best_center;
+            return moved;
+        });
+    }
+
+    // Half the distance from each center to its nearest other center
+    std::vector<float> half_nearest_center(std::vector<float>* pairwise) const {
+        std::vector<float> half(k, std::numeric_limits<float>::infinity());
+        if (pairwise) {
+            pairwise->assign(static_cast<size_t>(k) * k, 0.0f);
+        }
+        for (unsigned a = 0; a < k; ++a) {
+            for (unsigned b = a + 1; b < k; ++b) {
+                float distance_ab = center_distance(a, b);
+                half[a] = std::min(half[a], distance_ab / 2);
+                half[b] = std::min(half[b], distance_ab / 2);
+                if (pairwise) {
+                    (*pairwise)[a * k + b] = (*pairwise)[b * k + a] = distance_ab / 2;
+                }
+            }
+        }
+        return half;
+    }
+
+    size_t hamerly_pass(const std::vector<float>& moves) {
+        std::vector<float> half = half_nearest_center(nullptr);
+        unsigned farthest = std::max_element(moves.begin(), moves.end()) - moves.begin();
+        float largest = moves[farthest], second_largest = 0.0f;
+        for (unsigned c = 0; c < k; ++c) {
+            if (c != farthest) {
+                second_largest = std::max(second_largest, moves[c]);
+            }
+        }
+        return for_each_point("k-means hamerly", [&](size_t point, uint64_t& distances) {
+            unsigned assigned = result.labels[point];
+            upper[point] += moves[assigned];
+            lower[point] -= assigned == farthest ? second_largest : largest;
+            float bound = std::max(half[assigned], lower[point]);
+            if (upper[point] <= bound) {
+                return false;
+            }
+            upper[point] = distance(point, assigned);
+            ++distances;
+            if (upper[point] <= bound) {
+                return false;
+            }
+            float best = std::numeric_limits<float>::infinity(), second = best;
+            unsigned best_center = 0;
+            for (unsigned c = 0; c < k; ++c) {
+                float distance_to_c = c == assigned ? upper[point] : distance(point, c);
+                if (distance_to_c < best) {
+                    second = best;
+                    best = distance_to_c;
+                    best_center = c;
+                } else if (distance_to_c < second) {
+                    second = distance_to_c;
+                }
+            }
+            distances += k - 1;
+            upper[point] = best;
+            lower[point] = second;
+            result.labels[point] = best_center;
+            return best_center != assigned;
+        });
+    }
+
+    size_t elkan_pass(const std::vector<float>& moves) {
+        std::vector<float> half_pairwise;
+        std::vector<float> half = half_nearest_center(&half_pairwise);
+        return for_each_point("k-means elkan", [&](size_t point, uint64_t& distances) {
+            unsigned assigned = result.labels[point];
+            float* bounds = &lower[point * k];
+            for (unsigned c = 0; c < k; ++c) {
+                bounds[c] = std::max(0.0f, bounds[c] - moves[c]);
+            }
+            float u = upper[point] + moves[assigned];
+            if (u <= half[assigned]) {
+                upper[point] = u;
+                return false;
+            }
+            bool tight = false;
+            unsigned best_center = assigned;
+            for (unsigned c = 0; c < k; ++c) {
+                if (c == best_center || u <= bounds[c] || u <= half_pairwise[best_center * k + c]) {
+                    continue;
+                }
+                if (!tight) {
+                    u = distance(point, best_center);
+                    bounds[best_center] = u;
+                    ++distances;
+                    tight = true;
+                    if (u <= bounds[c] || u <= half_pairwise[best_center * k + c]) {
+                        continue;
+                    }
+                }
+                float distance_to_c = distance(point, c);
+                bounds[c] = distance_to_c;
+                ++distances;
+                if (distance_to_c < u) {
+                    u = distance_to_c;
+                    best_center = c;
+                }
+            }
+            upper[point] = u;
+            result.labels[point] = best_center;
+            return best_center != assigned;
+        });
+    }
+
+    // Recomputes the centers as the means of their points; moves receives each center's shift
+    void update_centers(std::vector<float>& moves) {
+        std::vector<double> sums(chunks * k * d, 0.0);
+        std::vector<size_t> members(chunks * k, 0);
+        scheduler().parallel_for("k-means centers", chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c) {
+                double* sum = &sums[c * k * d];
+                size_t* member = &members[c * k];
+                for (size_t point = c * FEATURE_CHUNK; point < std::min(count, (c + 1) * FEATURE_CHUNK); ++point) {
+                    unsigned label = result.labels[point];
+                    member[label]++;
+                    for (unsigned f = 0; f < d; ++f) {
+                        sum[label * d + f] += features.columns[f][point];
+                    }
+                }
+            }
+        });
+        for (unsigned center = 0; center < k; ++center) {
+            size_t total = 0;
+            std::vector<double> mean(d, 0.0);
+            for (size_t c = 0; c < chunks; ++c) {
+                total += members[c * k + center];
+                for (unsigned f = 0; f < d; ++f) {
+                    mean[f] += sums[(c * k + center) * d + f];
+                }
+            }
+            double shift = 0.0;
+            if (total > 0) {
+                for (unsigned f = 0; f < d; ++f) {
+                    float updated = static_cast<float>(mean[f] / total);
+                    double delta = updated - result.centers[center * d + f];
+                    shift += delta * delta;
+                    result.centers[center * d + f] = updated;
+                }
+            }
+            moves[center] = static_cast<float>(std::sqrt(shift));
+        }
+    }
+
+    const FeatureSet& features;
+    unsigned k;
+    unsigned d;
+    size_t count;
+    KMeansMethod method;
+    unsigned max_iterations;
+    size_t chunks;
+    std::vector<uint64_t> chunk_distances;
+    std::vector<float> upper;
+    std::vector<float> lower;
+    KMeansResult result;
+};
+
+const char* kmeans_method_name(KMeansMethod method) {
+    switch (method) {
+    case KMeansMethod::Lloyd: return "lloyd";
+    case KMeansMethod::Hamerly: return "hamerly";
+    case KMeansMethod::Elkan: return "elkan";
+    default: return "auto";
+    }
+}
+
+// A trained cluster model: the feature names with their standardization and training ranges,
+// and the centers in standardized units. Stored as tab-separated text so it can be inspected and
+// shipped with a scanner; material classes stay stable across scans, so one model labels many.
+struct ClusterModel {
+    FeatureSet features;  // statistics only
+    unsigned k = 0;
+    std::vector<float> centers;
+};
+
+const char* CLUSTER_MODEL_MAGIC = "cluster-model\t1";
+
+ClusterModel make_model(const FeatureSet& features, const KMeansResult& clusters) {
+    ClusterModel model;
+    model.features.names = features.names;
+    model.features.mean = features.mean;
+    model.features.scale = features.scale;
+    model.features.low = features.low;
+    model.features.high = features.high;
+    model.k = clusters.k;
+    model.centers = clusters.centers;
+    return model;
+}
+
+void save_model(const ClusterModel& model, const std::string& path) {
+    std::ofstream out(path, std::ios::trunc);
+    out << CLUSTER_MODEL_MAGIC << '\n' << std::setprecision(17);
+    const FeatureSet& features = model.features;
+    for (unsigned f = 0; f < features.dimensions(); ++f) {
+        out << "feature\t" << features.names[f] << '\t' << features.mean[f] << '\t' << features.scale[f] << '\t'
+            << features.low[f] << '\t' << features.high[f] << '\n';
+    }
+    out << std::setprecision(9);
+    for (unsigned c = 0; c < model.k; ++c) {
+        out << "center";
+        for (unsigned f = 0; f < features.dimensions(); ++f) {
+            out << '\t' << model.centers[c * features.dimensions() + f];
+        }
+        out << '\n';
+    }
+    if (!out) {
+        throw std::runtime_error("Error: could not write the cluster model to " + path + ".");
+    }
+}
+
+ClusterModel load_model(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != CLUSTER_MODEL_MAGIC) {
+        throw std::runtime_error("Error: " + path + " is not a cluster model.");
+    }
+    ClusterModel model;
+    FeatureSet& features = model.features;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind, name;
+        double mean, scale, low, high;
+        std::getline(fields, kind, '\t');
+        if (kind == "feature" && model.k == 0 && std::getline(fields, name, '\t') && fields >> mean >> scale >> low >> high) {
+            features.names.push_back(name);
+            features.mean.push_back(mean);
+            features.scale.push_back(scale);
+            features.low.push_back(low);
+            features.high.push_back(high);
+            continue;
+        }
+        float coordinate;
+        unsigned read = 0;
+        while (kind == "center" && fields >> coordinate) {
+            model.centers.push_back(coordinate);
+            ++read;
+        }
+        if (read == 0 || read != features.dimensions()) {
+            throw std::runtime_error("Error: malformed line in cluster model " + path + ": " + line);
+        }
+        ++model.k;
+    }
+    if (model.k == 0 || model.k > UINT16_MAX) {
+        throw std::runtime_error("Error: cluster model " + path + " has no usable centers.");
+    }
+    return model;
+}
+
+// Computes a model feature that derives from the calibrated value alone; false for other features
+bool value_feature(const std::string& name, double value, double& feature) {
+    if (name == "value") {
+        feature = value;
+    } else if (name == "thickness") {
+        feature = thickness_of(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A cluster model compiled into a dense label table, so labeling a pixel is one quantization and
+// one table read. A model whose features all derive from the calibrated value is keyed on that
+// value alone; any other model of one or two features is keyed on the features themselves. Each
+// axis quantizes the training range, clamping outside it, and every cell holds the label of the
+// center nearest to the cell's midpoint. A one-axis table is cheap to build and is the default;
+// a two-axis table costs about as much to build as labeling one scan exactly and is coarser, so it
+// is only built when asked for.
+const unsigned LUT_BINS_1D = 1 << 16;
+const unsigned LUT_BINS_2D = 1 << 10;
+
+class ClusterLut {
+public:
+    static bool value_derived(const ClusterModel& model) {
+        const auto& names = model.features.names;
+        double unused;
+        bool derived = std::find(names.begin(), names.end(), "value") != names.end();
+        for (const auto& name : names) {
+            derived = derived && value_feature(name, 0.0, unused);
+        }
+        return derived;
+    }
+
+    static bool compilable(const ClusterModel& model) {
+        return value_derived(model) || model.features.dimensions() <= 2;
+    }
+
+    static bool one_axis(const ClusterModel& model) {
+        return value_derived(model) || model.features.dimensions() == 1;
+    }
+
+    explicit ClusterLut(const ClusterModel& model) {
+        const FeatureSet& features = model.features;
+        unsigned d = features.dimensions();
+        auto value = std::find(features.names.begin(), features.names.end(), "value");
+        by_value = value_derived(model);
+        if (!compilable(model)) {
+            throw std::runtime_error("Error: a lookup table needs at most two features, or features derived from the calibrated value.");
+        }
+        axes = by_value ? 1 : d;
+        bins = axes == 1 ? LUT_BINS_1D : LUT_BINS_2D;
+        for (unsigned a = 0; a < axes; ++a) {
+            unsigned f = by_value ? value - features.names.begin() : a;
+            double range = features.high[f] - features.low[f];
+            low[a] = features.low[f];
+            step[a] = range > 0 ? range / bins : 1.0;
+        }
+        table.resize(axes == 1 ? bins : static_cast<size_t>(bins) * bins);
+        scheduler().parallel_for("lut compile", axes == 1 ? 1 : bins, 1, [&](size_t begin, size_t end) {
+            std::vector<float> point(d);
+            for (size_t row = begin; row < end; ++row) {
+                for (unsigned column = 0; column < bins; ++column) {
+                    double key[2] = {low[0] + ((axes == 1 ? column : row) + 0.5) * step[0], low[1] + (column + 0.5) * step[1]};
+                    for (unsigned f = 0; f < d; ++f) {
+                        double raw = key[f];
+                        if (by_value) {
+                            value_feature(features.names[f], key[0], raw);
+                        }
+                        point[f] = static_cast<float>((raw - features.mean[f]) / features.scale[f]);
+                    }
+                    table[row * bins + column] = nearest_center(point.data(), model.centers, d);
+                }
+            }
+        });
+    }
+
+    bool keyed_by_value() const { return by_value; }
+    size_t cells() const { return table.size(); }
+
+    uint16_t label(double key, double second_key = 0.0) const {
+        size_t cell = bin(0, key);
+        return table[axes == 1 ? cell : cell * bins + bin(1, second_key)];
+    }
+
+private:
+    size_t bin(unsigned axis, double key) const {
+        double position = (key - low[axis]) / step[axis];
+        return position > 0 ? std::min<size_t>(bins - 1, static_cast<size_t>(position)) : 0;
+    }
+
+    bool by_value = false;
+    unsigned axes = 1;
+    unsigned bins = 0;
+    double low[2] = {0.0, 0.0};
+    double step[2] = {1.0, 1.0};
+    std::vector<uint16_t> table;
+};
+
+// Cluster image: every pixel takes the grey level of its cluster's mean calibrated value, or
+// evenly spaced grey levels when the calibrated value is not one of the features
+void save_cluster_image(const FeatureSet& features, const KMeansResult& clusters, const std::string& filename) {
+    std::vector<unsigned char> grey(clusters.k);
+    unsigned value = std::find(features.names.begin(), features.names.end(), "value") - features.names.begin();
+    for (unsigned c = 0; c < clusters.k; ++c) {
+        double level = value < features.dimensions()
+            ? clusters.centers[c * clusters.dimensions + value] * features.scale[value] + features.mean[value]
+            : (clusters.k > 1 ? static_cast<double>(c) / (clusters.k - 1) : 0.5);
+        grey[c] = static_cast<unsigned char>(std::min(std::max(level, 0.0), 1.0) * 255);
+    }
+    std::vector<unsigned char> image(features.count() * BYTES_PER_PIXEL);
+    for (size_t k = 0; k < features.count(); ++k) {
+        std::fill_n(&image[k * BYTES_PER_PIXEL], BYTES_PER_PIXEL, grey[clusters.labels[k]]);
+    }
+    save_rgb_image(image.data(), features.height, features.width, filename);
+}
+
+const unsigned DEFAULT_KMEANS_ITERATIONS = 100;
+
+// Clusters the calibrated pixels of a scan and writes the cluster image
+int run_kmeans(const std::string& filename, const std::vector<std::string>& feature_names, unsigned k, KMeansMethod method,
+               unsigned max_iterations, const std::string& model_path) {
+    FrameBuffers frame;
+    read_frame(filename, frame);
+    ensure_calibrated(frame);
+    auto start = std::chrono::steady_clock::now();
+    FeatureSet features = build_features(frame.processed_data, feature_names);
+    double feature_milliseconds = elapsed_ms(start);
+    KMeans engine(features, k, method, max_iterations);
+    engine.seed(1);
+    KMeansResult clusters = engine.run();
+    double milliseconds = elapsed_ms(start);
+    save_cluster_image(features, clusters, image_name("clusters_image"));
+    uint64_t lloyd = static_cast<uint64_t>(features.count()) * k * clusters.iterations;
+    std::cout << "k-means (" << kmeans_method_name(engine.chosen_method()) << "): k=" << k << ", " << features.dimensions()
+              << " features, " << clusters.iterations << " iterations" << (clusters.converged ? " (converged)" : "") << ", "
+              << clusters.distance_computations << " distance computations (Lloyd: " << lloyd << "), mean squared distance "
+              << std::setprecision(5) << clusters.inertia << ", " << std::fixed << std::setprecision(3) << milliseconds
+              << " ms (features " << feature_milliseconds << " ms)." << std::endl;
+    std::cout << "Image '" << image_name("clusters_image") << "' generated successfully." << std::endl;
+    if (!model_path.empty()) {
+        save_model(make_model(features, clusters), model_path);
+        std::cout << "Model '" << model_path << "' saved." << std::endl;
+    }
+    return 0;
+}
+
+// Mini-batch k-means (Sculley): each step assigns a small batch of pixels to the current centers
+// and moves every assigned center toward its points with a per-center learning rate of
+// 1/(points seen), so the centers converge as a running mean. Memory is the batch, the seed
+// sample and the centers; the scan is read once more for the final labeling pass.
+const unsigned DEFAULT_MINIBATCH_SIZE = 1024;
+const unsigned DEFAULT_MINIBATCHES = 200;
+
+class MiniBatchKMeans {
+public:
+    MiniBatchKMeans(std::vector<float> centers, unsigned dimensions)
+        : centers(std::move(centers)), dimensions(dimensions), seen(this->centers.size() / dimensions, 0) {}
+
+    // One step over a row-major batch of standardized points
+    void update(const std::vector<float>& batch) {
+        size_t count = batch.size() / dimensions;
+        labels.resize(count);
+        scheduler().parallel_for("mini-batch assign", count, COLUMN_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t p = begin; p < end; ++p) {
+                labels[p] = nearest_center(&batch[p * dimensions], centers, dimensions);
+            }
+        });
+        for (size_t p = 0; p < count; ++p) {
+            float* center = &centers[labels[p] * dimensions];
+            float rate = 1.0f / ++seen[labels[p]];
+            for (unsigned f = 0; f < dimensions; ++f) {
+                center[f] += rate * (batch[p * dimensions + f] - center[f]);
+            }
+        }
+    }
+
+    const std::vector<float>& result() const { return centers; }
+
+private:
+    std::vector<float> centers;
+    unsigned dimensions;
+    std::vector<uint64_t> seen;
+    std::vector<uint16_t> labels;
+};
+
+// Clusters a scan from random pixel batches, or with streaming from batches drawn band by band
+// in row order, then labels every pixel once and writes the cluster image
+int run_minibatch(const std::string& filename, unsigned k, unsigned batch_size, unsigned batches, bool streaming,
+                  const std::string& model_path) {
+    FrameBuffers frame;
+    read_frame(filename, frame);
+    ensure_calibrated(frame);
+    auto start = std::chrono::steady_clock::now();
+    const auto& data = frame.processed_data;
+    FeatureSet features;  // statistics only: the per-pixel columns are never materialized
+    features.height = data.size();
+    features.width = data[0].size();
+    const unsigned d = INTENSITY_FEATURES;
+    if (k == 0 || k > UINT16_MAX || k > std::min<size_t>(features.count(), KMEANS_SEED_SAMPLE)) {
+        throw std::runtime_error("Error: k must be between 1 and the number of sampled pixels.");
+    }
+    if (batch_size > features.count()) {
+        throw std::runtime_error("Error: the batch size must not exceed the number of pixels.");
+    }
+    std::mt19937 random(1);
+    auto draw = [&](size_t first_row, size_t rows, size_t count, std::vector<float>& points) {
+        std::uniform_int_distribution<size_t> any_pixel(0, rows * features.width - 1);
+        points.resize(count * d);
+        for (size_t p = 0; p < count; ++p) {
+            size_t pixel = any_pixel(random);
+            intensity_features(data[first_row + pixel / features.width][pixel % features.width].value, &points[p * d]);
+        }
+    };
+
+    // Standardization statistics and k-means++ seeds from one uniform sample
+    std::vector<float> sample;
+    draw(0, features.height, std::min(features.count(), KMEANS_SEED_SAMPLE), sample);
+    size_t samples = sample.size() / d;
+    for (unsigned f = 0; f < d; ++f) {
+        double sum = 0.0, squares = 0.0, low = sample[f], high = sample[f];
+        for (size_t p = 0; p < samples; ++p) {
+            sum += sample[p * d + f];
+            squares += static_cast<double>(sample[p * d + f]) * sample[p * d + f];
+            low = std::min<double>(low, sample[p * d + f]);
+            high = std::max<double>(high, sample[p * d + f]);
+        }
+        double mean = sum / samples, variance = squares / samples - mean * mean;
+        features.names.push_back(f == 0 ? "value" : "thickness");
+        features.mean.push_back(mean);
+        features.scale.push_back(variance > 0 ? std::sqrt(variance) : 1.0);
+        features.low.push_back(low);
+        features.high.push_back(high);
+    }
+    auto standardize = [&](float* point) {
+        for (unsigned f = 0; f < d; ++f) {
+            point[f] = static_cast<float>((point[f] - features.mean[f]) / features.scale[f]);
+        }
+    };
+    for (size_t p = 0; p < samples; ++p) {
+        standardize(&sample[p * d]);
+    }
+    MiniBatchKMeans engine(kmeans_plus_plus(sample, d, k, random), d);
+
+    std::vector<float> batch;
+    for (unsigned b = 0; b < batches; ++b) {
+        if (streaming) {
+            size_t first_row = static_cast<size_t>(b) * features.height / batches;
+            size_t end_row = std::max(first_row + 1, static_cast<size_t>(b + 1) * features.height / batches);
+            draw(first_row, end_row - first_row, batch_size, batch);
+        } else {
+            draw(0, features.height, batch_size, batch);
+        }
+        for (size_t p = 0; p < batch_size; ++p) {
+            standardize(&batch[p * d]);
+        }
+        engine.update(batch);
+    }
+
+    KMeansResult clusters;
+    clusters.k = k;
+    clusters.dimensions = d;
+    clusters.centers = engine.result();
+    clusters.iterations = batches;
+    clusters.labels.resize(features.count());
+    std::vector<double> row_inertia(features.height);
+    scheduler().parallel_for("mini-batch label", features.height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (unsigned j = 0; j < features.width; ++j) {
+                float point[INTENSITY_FEATURES];
+                intensity_features(data[i][j].value, point);
+                standardize(point);
+                double squared;
+                clusters.labels[i * features.width + j] = nearest_center(point, clusters.centers, d, &squared);
+                row_inertia[i] += squared;
+            }
+        }
+    });
+    clusters.inertia = std::accumulate(row_inertia.begin(), row_inertia.end(), 0.0) / features.count();
+    clusters.distance_computations = (static_cast<uint64_t>(batches) * batch_size + features.count()) * k;
+    double milliseconds = elapsed_ms(start);
+    save_cluster_image(features, clusters, image_name("clusters_image"));
+    std::cout << "Mini-batch k-means" << (streaming ? " (streaming)" : "") << ": k=" << k << ", " << batches << " batches of "
+              << batch_size << " pixels, " << clusters.distance_computations << " distance computations, mean squared distance "
+              << std::setprecision(5) << clusters.inertia << ", " << std::fixed << std::setprecision(3) << milliseconds << " ms." << std::endl;
+    std::cout << "Image '" << image_name("clusters_image") << "' generated successfully." << std::endl;
+    if (!model_path.empty()) {
+        save_model(make_model(features, clusters), model_path);
+        std::cout << "Model '" << model_path << "' saved." << std::endl;
+    }
+    return 0;
+}
+
+enum class Labeling { Auto, Exact, Table };
+
+// Labels a scan with a saved cluster model, by computing the nearest center of every pixel or
+// through the model's lookup table: by default when the table has one axis, or on request
+int run_apply_model(const std::string& model_path, const std::string& filename, Labeling labeling) {
+    ClusterModel model = load_model(model_path);
+    FrameBuffers frame;
+    read_frame(filename, frame);
+    ensure_calibrated(frame);
+    const auto& data = frame.processed_data;
+    FeatureSet& features = model.features;
+    features.height = data.size();
+    features.width = data[0].size();
+    unsigned d = features.dimensions();
+    KMeansResult clusters;
+    clusters.k = model.k;
+    clusters.dimensions = d;
+    clusters.centers = model.centers;
+    clusters.labels.resize(features.count());
+    auto start = std::chrono::steady_clock::now();
+    bool by_value = ClusterLut::value_derived(model);
+    FeatureSet raw;  // unstandardized features of the scan, unless all derive from the calibrated value
+    if (!by_value) {
+        raw = extract_features(data, features.names);
+    }
+    std::unique_ptr<ClusterLut> lut;
+    if (labeling == Labeling::Table || (labeling == Labeling::Auto && ClusterLut::one_axis(model))) {
+        lut.reset(new ClusterLut(model));
+    }
+    double prepare_milliseconds = elapsed_ms(start);
+    scheduler().parallel_for("apply model", features.height, ROW_GRAIN, [&](size_t begin, size_t end) {
+        std::vector<float> point(d);
+        for (size_t i = begin; i < end; ++i) {
+            uint16_t* labels = &clusters.labels[i * features.width];
+            size_t first = i * features.width;
+            if (lut && by_value) {
+                for (unsigned j = 0; j < features.width; ++j) {
+                    labels[j] = lut->label(data[i][j].value);
+                }
+            } else if (lut) {
+                const float* second = raw.columns[d - 1].data() + first;
+                for (unsigned j = 0; j < features.width; ++j) {
+                    labels[j] = lut->label(raw.columns[0][first + j], second[j]);
+                }
+            } else {
+                for (unsigned j = 0; j < features.width; ++j) {
+                    for (unsigned f = 0; f < d; ++f) {
+                        double value = 0.0;
+                        if (by_value) {
+                            value_feature(features.names[f], data[i][j].value, value);
+                        } else {
+                            value = raw.columns[f][first + j];
+                        }
+                        point[f] = static_cast<float>((value - features.mean[f]) / features.scale[f]);
+                    }
+                    labels[j] = nearest_center(point.data(), model.centers, d);
+                }
+            }
+        }
+    });
+    double milliseconds = elapsed_ms(start);
+    save_cluster_image(features, clusters, image_name("clusters_image"));
+    std::cout << "Model '" << model_path << "': k=" << model.k << ", " << d << " features, labeled ";
+    if (lut) {
+        std::cout << "through a " << lut->cells() << "-cell lookup table";
+    } else {
+        std::cout << "by nearest center";
+    }
+    std::cout << " in " << std::fixed << std::setprecision(3) << milliseconds << (lut ? " ms (features and table " : " ms (features ")
+              << prepare_milliseconds << " ms)." << std::endl;
+    std::cout << "Image '" << image_name("clusters_image") << "' generated successfully." << std::endl;
+    return 0;
+}
+
+// Stages of an interactive session as a dependency graph. Each stage remembers a fingerprint of
+// its parameters and of the result generations of its inputs; evaluating a stage first evaluates
+// its inputs and then reruns it only when that fingerprint changed, so a parameter change
+// recomputes exactly the stages downstream of it while every other intermediate is reused.
+class StageGraph {
+public:
+    int add(const char* name, std::vector<int> inputs, std::function<uint64_t()> parameters, std::function<void()> compute) {
+        stages.push_back({name, std::move(inputs), std::move(parameters), std::move(compute)});
+        return stages.size() - 1;
+    }
+
+    void evaluate(int index) {
+        Stage& stage = stages[index];
+        uint64_t fingerprint = fnv1a(nullptr, 0);
+        for (int input : stage.inputs) {
+            evaluate(input);
+            fingerprint = fnv1a(&stages[input].generation, sizeof(stages[input].generation), fingerprint);
+        }
+        uint64_t parameters = stage.parameters ? stage.parameters() : 0;
+        fingerprint = fnv1a(&parameters, sizeof(parameters), fingerprint);
+        if (stage.valid && fingerprint == stage.fingerprint) {
+            return;
+        }
+        // A failed stage is left invalid with a new generation, so it and every stage that
+        // depends on it rerun on the next evaluation even if the parameters change back
+        stage.valid = false;
+        ++stage.generation;
+        stage.compute();
+        stage.fingerprint = fingerprint;
+        stage.valid = true;
+        recomputed.push_back(stage.name);
+    }
+
+    // Names of the stages that ran since the previous call
+    std::vector<const char*> take_recomputed() {
+        return std::move(recomputed);
+    }
+
+private:
+    struct Stage {
+        const char* name;
+        std::vector<int> inputs;
+        std::function<uint64_t()> parameters;
+        std::function<void()> compute;
+        uint64_t fingerprint = 0;
+        uint64_t generation = 0;
+        bool valid = false;
+    };
+
+    std::vector<Stage> stages;
+    std::vector<const char*> recomputed;
+};
+
+struct SessionParameters {
+    std::string path;
+    int threshold = SIGNAL_THRESHOLD;
+    DoseMonitor monitor;
+    bool reference_auto = false;
+    ReferenceRegions regions;
+    double grey_levels = THICKNESS_GREY_LEVELS;
+};
+
+// Hash of a value's bytes, for stage parameter fingerprints
+template <typename... Values>
+uint64_t fingerprint_of(const Values&... values) {
+    uint64_t hash = fnv1a(nullptr, 0);
+    ((hash = fnv1a(&values, sizeof(values), hash)), ...);
+    return hash;
+}
+
+// Interactive session on one scan: commands on stdin change parameters or write images, and only
+// the stages affected by the changed parameters are recomputed for the next image.
+int run_session(const std::string& initial_path) {
+    SessionParameters parameters;
+    parameters.path = initial_path;
+    FrameBuffers frame;
+    ReferenceRegions regions;
+    std::vector<std::vector<PixelData>> beta_corrected;
+    std::vector<std::vector<PixelData>> calibrated;
+    std::vector<std::vector<double>> thickness;
+    std::vector<unsigned char> normalized_image;
+    std::vector<unsigned char> thickness_image;
+
+    StageGraph graph;
+    int read = graph.add("read", {}, [&]() {
+        struct stat info{};
+        stat(parameters.path.c_str(), &info);
+        return fnv1a(parameters.path.data(), parameters.path.size(), fingerprint_of(info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec));
+    }, [&]() {
+        FrameBuffers next;  // the current scan stays intact if the new one cannot be read
+        read_frame(parameters.path, next);
+        std::swap(frame, next);
+    });
+    int normalize = graph.add("normalize", {read}, [&]() { return fingerprint_of(parameters.threshold); },
+                              [&]() { normalize_frame(frame, parameters.threshold); });
+    int reference = graph.add("reference regions", {normalize}, [&]() {
+        return fingerprint_of(parameters.reference_auto, parameters.regions.beta_first_row, parameters.regions.detector_first_column);
+    }, [&]() { regions = parameters.reference_auto ? choose_reference_regions(frame) : parameters.regions; });
+    int beta = graph.add("beta-thorne correction", {normalize, reference}, [&]() {
+        return fingerprint_of(parameters.monitor.source, parameters.monitor.index);
+    }, [&]() {
+        beta_corrected = frame.processed_data;
+        correct_beta_pulses(beta_corrected, frame.median_betathrone, frame.pulses, regions, parameters.monitor);
+    });
+    int detectors = graph.add("detector correction", {beta, reference}, nullptr, [&]() {
+        calibrated = beta_corrected;
+        correct_detectors(calibrated, frame.median_detector, regions);
+    });
+    int thickness_stage = graph.add("thickness", {detectors}, nullptr, [&]() {
+        thickness.resize(calibrated.size());
+        scheduler().parallel_for("thickness", calibrated.size(), ROW_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                thickness[i].resize(calibrated[i].size());
+                for (size_t j = 0; j < calibrated[i].size(); ++j) {
+                    thickness[i][j] = thickness_of(calibrated[i][j].value);
+                }
+            }
+        });
+    });
+    int render_normalized = graph.add("render normalized", {detectors}, nullptr, [&]() {
+        size_t widthInBytes = static_cast<size_t>(frame.width) * BYTES_PER_PIXEL;
+        normalized_image.resize(widthInBytes * frame.height);
+        scheduler().parallel_for("render normalized", frame.height, 4, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                render_normalized_row(calibrated[i], &normalized_image[i * widthInBytes]);
+            }
+        });
+    });
+    int render_thickness = graph.add("render thickness", {thickness_stage}, [&]() { return fingerprint_of(parameters.grey_levels); }, [&]() {
+        size_t widthInBytes = static_cast<size_t>(frame.width) * BYTES_PER_PIXEL;
+        thickness_image.resize(widthInBytes * frame.height);
+        scheduler().parallel_for("render thickness", frame.height, 4, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                unsigned char* row = &thickness_image[i * widthInBytes];
+                for (unsigned j = 0; j < frame.width; ++j) {
+                    unsigned char color_value = thickness_grey(thickness[i][j], parameters.grey_levels);
+                    row[j * BYTES_PER_PIXEL + 0] = color_value;
+                    row[j * BYTES_PER_PIXEL + 1] = color_value;
+                    row[j * BYTES_PER_PIXEL + 2] = color_value;
+                }
+            }
+        });
+    });
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::istringstream words(line);
+        std::string command, argument;
+        words >> command >> argument;
+        if (command.empty()) {
+            continue;
+        }
+        if (command == "quit") {
+            break;
+        }
+        try {
+            if (command == "open" && !argument.empty()) {
+                parameters.path = argument;
+            } else if (command == "threshold" && !argument.empty()) {
+                parameters.threshold = std::stoi(argument);
+            } else if (command == "dose-monitor" && !argument.empty()) {
+                DoseMonitor monitor;
+                if (argument != "beta" && !parse_dose_monitor(argument, monitor)) {
+                    throw std::runtime_error("Error: dose-monitor expects beta, pulse:<channel> or row:<detector row>");
+                }
+                parameters.monitor = monitor;
+            } else if (command == "reference" && !argument.empty()) {
+                parameters.reference_auto = argument == "auto";
+                parameters.regions = ReferenceRegions();
+                if (argument != "auto" && argument != "standard" &&
+                    std::sscanf(argument.c_str(), "%d:%d", &parameters.regions.beta_first_row, &parameters.regions.detector_first_column) != 2) {
+                    throw std::runtime_error("Error: reference expects standard, auto or <first row>:<first column>");
+                }
+            } else if (command == "thickness-scale" && !argument.empty()) {
+                parameters.grey_levels = std::stod(argument);
+            } else if (command == "write" && (argument == "normalized" || argument == "thickness")) {
+                std::string output;
+                words >> output;
+                if (output.empty()) {
+                    output = image_name(argument + "_image");
+                }
+                bool normalized = argument == "normalized";
+                graph.evaluate(normalized ? render_normalized : render_thickness);
+                save_rgb_image((normalized ? normalized_image : thickness_image).data(), frame.height, frame.width, output);
+                std::vector<const char*> recomputed = graph.take_recomputed();
+                std::cout << "Image '" << output << "' generated";
+                for (size_t k = 0; k < recomputed.size(); ++k) {
+                    std::cout << (k == 0 ? " (recomputed: " : ", ") << recomputed[k];
+                }
+                std::cout << (recomputed.empty() ? " (all stages reused)." : ").") << std::endl;
+            } else {
+                throw std::runtime_error("Error: unknown command '" + line + "'");
+            }
+        } catch (const std::exception& e) {
+            graph.take_recomputed();
+            std::cerr << e.what() << std::endl;
+        }
+    }
+    return 0;
+}
+
+int run_command(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--alloc-test") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --alloc-test file.int [passes]" << std::endl;
+            return 1;
+        }
+        try {
+            return run_alloc_test(argv[2], argc > 3 ? parse_count(argv[3], "--alloc-test passes") : 3);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && (std::string(argv[1]) == "--serve" || std::string(argv[1]) == "--submit")) {
+        std::string mode = argv[1];
+        try {
+            if (mode == "--serve" && argc >= 3) {
+                unsigned workers = argc > 3 ? parse_count(argv[3], "--serve workers") : DEFAULT_SERVICE_WORKERS;
+                if (workers == 0) {
+                    throw std::runtime_error("Error: --serve needs at least 1 worker.");
+                }
+                return run_service(argv[2], workers);
+            }
+            if (mode == "--submit" && argc >= 4) {
+                return run_submit(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << "Usage: " << argv[0] << " --serve socket [workers]" << std::endl
+                  << "       " << argv[0] << " --submit socket scan.int... [SHUTDOWN]" << std::endl;
+        return 1;
+    }
+    if (argc > 1 && (std::string(argv[1]) == "--simulate" || std::string(argv[1]) == "--receive")) {
+        std::string mode = argv[1];
+        try {
+            if (mode == "--simulate" && argc >= 4) {
+                return run_simulator(argv[2], argv[3], argc > 4 ? std::stod(argv[4]) : 1000.0);
+            }
+            if (mode == "--receive" && argc >= 3) {
+                return run_receiver(argv[2], argc > 3 ? argv[3] : image_name("received_image"));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << "Usage: " << argv[0] << " --simulate file.int socket [lines_per_second]" << std::endl
+                  << "       " << argv[0] << " --receive socket [output.bmp]" << std::endl;
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--ring-test") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --ring-test file.int [lines_per_second] [capacity]" << std::endl;
+            return 1;
+        }
+        try {
+            double rate = argc > 3 ? std::stod(argv[3]) : 0.0;
+            size_t capacity = argc > 4 ? std::stoul(argv[4]) : LINE_RING_CAPACITY;
+            if (capacity == 0) {
+                throw std::runtime_error("Error: ring capacity must be positive.");
+            }
+            return run_ring_test(argv[2], rate, capacity);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        bool with_thickness = false;
+        std::string shm_name;
+        std::string io_backend;
+        std::vector<std::string> inputs;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--thickness") {
+                with_thickness = true;
+            } else if (arg == "--shm" && i + 1 < argc) {
+                shm_name = argv[++i];
+            } else if (arg == "--io" && i + 1 < argc) {
+                io_backend = argv[++i];
+            } else {
+                inputs.push_back(arg);
+            }
+        }
+        if (inputs.empty()) {
+            std::cerr << "Usage: " << argv[0] << " --batch [--thickness] [--shm name] [--io uring|threads] file.int..." << std::endl;
+            return 1;
+        }
+        if (!io_backend.empty()) {
+            if (io_backend != "uring" && io_backend != "threads") {
+                std::cerr << "An error occurred: Error: --io expects uring or threads, got '" << io_backend << "'." << std::endl;
+                return 1;
+            }
+            try {
+                return run_async_batch(inputs, with_thickness, io_backend == "uring", shm_name);
+            } catch (const std::exception& e) {
+                std::cerr << "An error occurred: " << e.what() << std::endl;
+                return 1;
+            }
+        }
+        return run_batch(inputs, with_thickness, shm_name);
+    }
+
+    if (argc > 1 && (std::string(argv[1]) == "--index-build" || std::string(argv[1]) == "--index-query")) {
+        std::string mode = argv[1];
+        try {
+            if (mode == "--index-build" && argc >= 4) {
+                return build_catalog(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+            }
+            if (mode == "--index-query" && argc >= 3) {
+                CatalogQuery query;
+                for (int i = 3; i < argc; ++i) {
+                    std::string arg = argv[i];
+                    size_t eq = arg.find('=');
+                    std::string key = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+                    if (key == "width") query.width = std::stoul(value);
+                    else if (key == "height") query.height = std::stoul(value);
+                    else if (key == "label") query.label = value;
+                    else if (key == "since") query.since = parse_date(value);
+                    else if (key == "until") query.until = parse_date(value) + SECONDS_PER_DAY;
+                    else throw std::runtime_error("Error: unknown query field " + key);
+                }
+                return query_catalog(argv[2], query);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << "Usage: " << argv[0] << " --index-build index.idx dir_or_file..." << std::endl
+                  << "       " << argv[0] << " --index-query index.idx [width=N] [height=N] [label=TEXT] [since=YYYY-MM-DD] [until=YYYY-MM-DD]" << std::endl;
+        return 1;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--inspect") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --inspect file.int" << std::endl;
+            return 1;
+        }
+        try {
+            return inspect_scan(argv[2]);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--numa-batch") {
+        bool with_thickness = false;
+        std::string policy_name = "least-loaded", workers_text;
+        std::vector<std::string> inputs;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--thickness") {
+                with_thickness = true;
+            } else if (arg == "--policy" && i + 1 < argc) {
+                policy_name = argv[++i];
+            } else if (arg == "--workers-per-node" && i + 1 < argc) {
+                workers_text = argv[++i];
+            } else {
+                inputs.push_back(arg);
+            }
+        }
+        if (inputs.empty()) {
+            std::cerr << "Usage: " << argv[0] << " --numa-batch [--thickness] [--policy round-robin|least-loaded] [--workers-per-node N] file.int..." << std::endl;
+            return 1;
+        }
+        try {
+            if (policy_name != "least-loaded" && policy_name != "round-robin") {
+                throw std::runtime_error("Error: --policy expects round-robin or least-loaded, got '" + policy_name + "'.");
+            }
+            NodePolicy policy = policy_name == "round-robin" ? NodePolicy::RoundRobin : NodePolicy::LeastLoaded;
+            unsigned workers_per_node = workers_text.empty() ? 0 : parse_count(workers_text, "--workers-per-node");
+            return run_numa_batch(inputs, with_thickness, policy, workers_per_node, 0, false);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--numa-bench") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --numa-bench file.int [scans]" << std::endl;
+            return 1;
+        }
+        try {
+            return run_numa_bench(argv[2], argc > 3 ? parse_count(argv[3], "--numa-bench scans") : 32);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--roi") {
+        bool with_thickness = false;
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; ++i) {
+            if (std::string(argv[i]) == "--thickness") {
+                with_thickness = true;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        if (args.size() != 4 && args.size() != 5) {
+            std::cerr << "Usage: " << argv[0] << " --roi column row width height [--thickness] [file.int]" << std::endl;
+            return 1;
+        }
+        try {
+            return run_roi(args.size() == 5 ? args[4] : "block.int", std::stoul(args[0]), std::stoul(args[1]),
+                           std::stoul(args[2]), std::stoul(args[3]), with_thickness);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--progressive") {
+        bool with_thickness = false;
+        std::string input = "block.int", factor_text;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--thickness") {
+                with_thickness = true;
+            } else if (arg == "--factor" && i + 1 < argc) {
+                factor_text = argv[++i];
+            } else {
+                input = arg;
+            }
+        }
+        try {
+            unsigned factor = factor_text.empty() ? DEFAULT_PREVIEW_FACTOR : parse_count(factor_text, "--factor");
+            if (factor == 0) {
+                std::cerr << "Usage: " << argv[0] << " --progressive [--factor N] [--thickness] [file.int]" << std::endl;
+                return 1;
+            }
+            return run_progressive(input, factor, with_thickness);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--apply-model") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --apply-model model.txt [--exact|--table] [file.int]" << std::endl;
+            return 1;
+        }
+        Labeling labeling = Labeling::Auto;
+        std::string input = "block.int";
+        for (int i = 3; i < argc; ++i) {
+            if (std::string(argv[i]) == "--exact") {
+                labeling = Labeling::Exact;
+            } else if (std::string(argv[i]) == "--table") {
+                labeling = Labeling::Table;
+            } else {
+                input = argv[i];
+            }
+        }
+        try {
+            return run_apply_model(argv[2], input, labeling);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--minibatch") {
+        bool streaming = false;
+        std::string input = "block.int", model_path, batch_text, batches_text;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--batch" && i + 1 < argc) {
+                batch_text = argv[++i];
+            } else if (arg == "--batches" && i + 1 < argc) {
+                batches_text = argv[++i];
+            } else if (arg == "--stream") {
+                streaming = true;
+            } else if (arg == "--save-model" && i + 1 < argc) {
+                model_path = argv[++i];
+            } else {
+                input = arg;
+            }
+        }
+        try {
+            unsigned k = argc > 2 ? parse_count(argv[2], "--minibatch k") : 0;
+            unsigned batch_size = batch_text.empty() ? DEFAULT_MINIBATCH_SIZE : parse_count(batch_text, "--batch");
+            unsigned batches = batches_text.empty() ? DEFAULT_MINIBATCHES : parse_count(batches_text, "--batches");
+            if (k == 0 || batch_size == 0 || batches == 0) {
+                std::cerr << "Usage: " << argv[0] << " --minibatch k [--batch B] [--batches N] [--stream] [--save-model FILE] [file.int]" << std::endl;
+                return 1;
+            }
+            return run_minibatch(input, k, batch_size, batches, streaming, model_path);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--kmeans") {
+        std::string input = "block.int", model_path, feature_list = DEFAULT_FEATURES, method_name = "auto", iterations_text;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--features" && i + 1 < argc) {
+                feature_list = argv[++i];
+            } else if (arg == "--method" && i + 1 < argc) {
+                method_name = argv[++i];
+            } else if (arg == "--iterations" && i + 1 < argc) {
+                iterations_text = argv[++i];
+            } else if (arg == "--save-model" && i + 1 < argc) {
+                model_path = argv[++i];
+            } else {
+                input = arg;
+            }
+        }
+        const char* usage = " --kmeans k [--features LIST] [--method auto|lloyd|hamerly|elkan] [--iterations N] [--save-model FILE] [file.int]";
+        if (method_name != "auto" && method_name != "lloyd" && method_name != "hamerly" && method_name != "elkan") {
+            std::cerr << "Error: --method expects auto, lloyd, hamerly or elkan, got '" << method_name << "'." << std::endl;
+            std::cerr << "Usage: " << argv[0] << usage << std::endl;
+            return 1;
+        }
+        KMeansMethod method = method_name == "lloyd" ? KMeansMethod::Lloyd : method_name == "hamerly" ? KMeansMethod::Hamerly
+                            : method_name == "elkan" ? KMeansMethod::Elkan : KMeansMethod::Auto;
+        try {
+            unsigned k = argc > 2 ? parse_count(argv[2], "--kmeans k") : 0;
+            unsigned iterations = iterations_text.empty() ? DEFAULT_KMEANS_ITERATIONS : parse_count(iterations_text, "--iterations");
+            if (k == 0 || iterations == 0) {
+                std::cerr << "Usage: " << argv[0] << usage << std::endl;
+                return 1;
+            }
+            return run_kmeans(input, split_feature_names(feature_list), k, method, iterations, model_path);
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--session") {
+        return run_session(argc > 2 ? argv[2] : "block.int");
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--shm-read") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --shm-read name [output.bmp]" << std::endl;
+            return 1;
+        }
+        try {
+            return read_shared_memory_frame(argv[2], argc > 3 ? argv[3] : image_name("shared_image"));
+        } catch (const std::exception& e) {
+            std::cerr << "An error occurred: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::string shm_name;
+    if (argc > 2 && std::string(argv[1]) == "--shm") {
+        shm_name = argv[2];
+    }
+
+    try {
+        FrameBuffers frame;
+        read_frame("block.int", frame);
+        const auto& processed_data = frame.processed_data;
+        save_output(frame, "normalized", image_name("normalized_image"), create_and_save_image);
+        
+        std::cout << "Image '" << image_name("normalized_image") << "' generated successfully." << std::endl;
+        if (!shm_name.empty()) {
+            ensure_calibrated(frame);
+            publish_to_shared_memory(processed_data, shm_name);
+            std::cout << "Frame published to shared memory '" << shm_name << "'." << std::endl;
+        }
+
+        int choice;
+        std::cout << "Input 1 to check thickness: ";
+        std::cin >> choice;
+        if (choice == 1) {
+            save_output(frame, "thickness", image_name("thickness_image"), calculate_and_save_thickness);
+            std::cout << "Image '" << image_name("thickness_image") << "' generated successfully." << std::endl;
+        }
+
+    } catch (const std::exception& e) {
+        std::cerr << "An error occurred: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // Global options may appear anywhere; they are removed before the mode is dispatched
+    bool print_task_stats = false;
+    std::string cache_directory;
+    uint64_t cache_limit = DEFAULT_RESULT_CACHE_LIMIT;
+    for (int i = 1; i < argc; ) {
+        std::string arg = argv[i];
+        int consumed = 0;
+        if (arg == "--huge-pages") {
+            use_huge_pages = true;
+            consumed = 1;
+        } else if (arg == "--task-stats") {
+            print_task_stats = true;
+            consumed = 1;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            try {
+                scheduler_threads = parse_count(argv[i + 1], "--threads");
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            if (scheduler_threads == 0) {
+                std::cerr << "Error: --threads expects at least 1 thread" << std::endl;
+                return 1;
+            }
+            consumed = 2;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_directory = argv[i + 1];
+            consumed = 2;
+        } else if (arg == "--cache-limit" && i + 1 < argc) {
+            uint64_t megabytes;
+            try {
+                megabytes = parse_count(argv[i + 1], "--cache-limit");
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            if (megabytes == 0 || megabytes > (UINT64_MAX >> 20)) {
+                std::cerr << "Error: --cache-limit expects a size in MB of at least 1" << std::endl;
+                return 1;
+            }
+            cache_limit = megabytes << 20;
+            consumed = 2;
+        } else if (arg == "--format" && i + 1 < argc) {
+            std::string format = argv[i + 1];
+            if (format != "bmp" && format != "png" && format != "qoi" && format != "tif") {
+                std::cerr << "Error: --format expects bmp, png, qoi or tif" << std::endl;
+                return 1;
+            }
+            output_format = format_of("." + format);
+            consumed = 2;
+        } else if (arg == "--tiff-bits" && i + 1 < argc) {
+            tiff_options.bits = std::atoi(argv[i + 1]);
+            if (tiff_options.bits != 8 && tiff_options.bits != 16) {
+                std::cerr << "Error: --tiff-bits expects 8 or 16" << std::endl;
+                return 1;
+            }
+            consumed = 2;
+        } else if (arg == "--tiff-compression" && i + 1 < argc) {
+            std::string compression = argv[i + 1];
+            if (compression != "deflate" && compression != "none") {
+                std::cerr << "Error: --tiff-compression expects deflate or none" << std::endl;
+                return 1;
+            }
+            tiff_options.deflate = compression == "deflate";
+            consumed = 2;
+        } else if (arg == "--reference" && i + 1 < argc) {
+            std::string mode = argv[i + 1];
+            if (mode != "auto" && mode != "standard") {
+                std::cerr << "Error: --reference expects auto or standard" << std::endl;
+                return 1;
+            }
+            reference_auto = mode == "auto";
+            consumed = 2;
+        } else if (arg == "--dose-monitor" && i + 1 < argc) {
+            if (!parse_dose_monitor(argv[i + 1], dose_monitor)) {
+                std::cerr << "Error: --dose-monitor expects pulse:<channel> or row:<detector row>" << std::endl;
+                return 1;
+            }
+            consumed = 2;
+        }
+        if (consumed == 0) {
+            ++i;
+            continue;
+        }
+        std::copy(argv + i + consumed, argv + argc, argv + i);
+        argc -= consumed;
+    }
+
+    if (!cache_directory.empty()) {
+        try {
+            result_cache = std::make_unique<ResultCache>(cache_directory, cache_limit);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: could not open result cache " << cache_directory << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    int status = run_command(argc, argv);
+    if (print_task_stats) {
+        task_stats.report(std::cerr);
+    }
+    return status;
+}